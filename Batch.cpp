@@ -0,0 +1,426 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "Batch.h"
+#include "ErosionGrid.h"
+#include "fractal.h"
+#include "HeightmapExport.h"
+#include "mathfuncs.h"
+#include "random.h"
+#include "ThreadPool.h"
+
+//threads besides erosion: generating, combining and writing, and the encoder and I/O thread of the HeightmapExport
+//behind writing
+const int BATCH_STAGE_THREADS = 5;
+
+//hands terrains from one stage to the next
+template<class T>
+class BatchQueue
+{
+public:
+  BatchQueue() : closed(false) {}
+
+  void push(const T& item)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    items.push_back(item);
+    ready.notify_one();
+  }
+
+  //waits for the next item, returns false once the queue is closed and empty
+  bool pop(T& item)
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    ready.wait(guard, [this] { return !items.empty() || closed; });
+    if(items.empty())
+      return false;
+
+    item = items.front();
+    items.pop_front();
+    return true;
+  }
+
+  //no more items will be pushed
+  void close()
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    closed = true;
+    ready.notify_all();
+  }
+
+private:
+  std::deque<T> items;
+  std::mutex lock;
+  std::condition_variable ready;
+  bool closed;
+};
+
+//bytes of terrains in flight, see BatchSettings::memoryBudget
+class MemoryBudget
+{
+public:
+  MemoryBudget(size_t limit) : limit(limit), used(0) {}
+
+  void acquire(size_t bytes)
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    released.wait(guard, [&] { return used == 0 || used + bytes <= limit; });
+    used += bytes;
+  }
+
+  void release(size_t bytes)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    used -= bytes;
+    released.notify_all();
+  }
+
+private:
+  size_t limit;
+  size_t used;
+  std::mutex lock;
+  std::condition_variable released;
+};
+
+//a terrain on its way through the batch
+struct BatchTerrain
+{
+  BatchTerrain() : job(NULL), bytes(0), terrain(NULL), water(NULL), failed(false) {}
+
+  const BatchJob* job;
+  size_t bytes;
+  float* terrain;
+  float* water;
+  bool failed;
+};
+
+bool eroding(const BatchJob& job)
+{
+  return job.erosion.iterations > 0;
+}
+
+//the same terrain maingen writes for a seed and size
+float* generateTerrain(uint64_t seed, int size)
+{
+  int iterations = 0;
+  while((1 << iterations) + 1 < size)
+    iterations++;
+
+  float startFractal[4];
+  for(int i = 0; i < 4; i++)
+    startFractal[i] = randomRange(0.5, 0.7, randomUnit(seed, RANDOM_START, 0, i, 0));
+
+  float* finished;
+  makeFractalArray(&startFractal[0], 2, finished, size, iterations, seed);
+  return finished;
+}
+
+void combineTerrain(float* terrain, int size, uint64_t seed, int threads)
+{
+  const int BROAD_SIZE = 6;
+  const int FINE_SIZE = 24;
+  size_t cells = size_t(size) * size;
+
+  std::vector<float> start(BROAD_SIZE * BROAD_SIZE);
+  for(int i = 0; i < BROAD_SIZE * BROAD_SIZE; i++)
+    start[i] = randomRange(0.0, 1.0, randomUnit(seed, RANDOM_START, 1, i, 0));
+  std::vector<float> broad(cells);
+  bicubicInterpolate(&start[0], BROAD_SIZE, &broad[0], size, threads);
+
+  start.resize(FINE_SIZE * FINE_SIZE);
+  for(int i = 0; i < FINE_SIZE * FINE_SIZE; i++)
+    start[i] = randomRange(-0.15, 0.15, randomUnit(seed, RANDOM_START, 2, i, 0));
+  std::vector<float> fine(cells);
+  bicubicInterpolate(&start[0], FINE_SIZE, &fine[0], size, threads);
+
+  for(size_t i = 0; i < cells; i++)
+  {
+    float coefficient = std::max(0.0f, (broad[i] - 0.1f) * 1.5f);
+    terrain[i] = broad[i] + fine[i] + terrain[i] * coefficient;
+  }
+}
+
+size_t batchJobBytes(const BatchJob& job)
+{
+  size_t cells = size_t(job.size) * job.size;
+
+  //the terrain is held throughout, next to the two noise layers while combining, the grid and the eroded
+  //terrain and water while eroding, and the water, splat map and normal map while writing
+  size_t perCell = 4 + (job.combine ? 8 : 0);
+  if(eroding(job))
+    perCell = std::max(perCell, size_t(4 + (job.erosion.halfPrecision ? EROSION_GRID_HALF_BYTES_PER_CELL : EROSION_GRID_BYTES_PER_CELL) + 8));
+  perCell = std::max(perCell, size_t(4 + (eroding(job) ? 4 : 0) + (job.splat ? 7 : 0)));
+  return cells * perCell;
+}
+
+//a terrain whose heightmaps are being written in the background, freed once the last one is done
+struct BatchWrite
+{
+  BatchTerrain terrain;
+  int pending;
+  bool ok;
+};
+
+//writes the splat map and normal map of a finished terrain, returning false if either cannot be written
+bool writeSplat(const BatchTerrain& t)
+{
+  const BatchJob& job = *t.job;
+  SplatSettings settings;
+  settings.threads = 1;
+  std::vector<unsigned char> normals(size_t(job.size) * job.size * 3);
+  unsigned char* splat = genSplat(t.terrain, t.water, NULL, job.size, &normals[0], settings);
+  bool ok = writePixmap(job.name + "-splat.pam", splat, job.size, job.size, 4);
+  ok = writePixmap(job.name + "-normal.ppm", &normals[0], job.size, job.size, 3) && ok;
+  delete[] splat;
+  return ok;
+}
+
+BatchResult runBatch(const std::vector<BatchJob>& jobs, const BatchSettings& settings)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  //erosion gets what the stage threads leave, but never less than a thread per run
+  int threads = settings.threads > 0 ? settings.threads : ThreadPool::defaultThreadCount();
+  int erosionThreads = std::max(threads - BATCH_STAGE_THREADS, 1);
+  int runs = std::max(1, std::min(settings.erosionRuns, erosionThreads));
+
+  MemoryBudget budget(settings.memoryBudget);
+  BatchQueue<BatchTerrain> toCombine, toErode, toWrite;
+  BatchResult result;
+
+  //terrains start in order, each once the budget has room for it
+  std::thread generator([&]
+  {
+    for(size_t j = 0; j < jobs.size(); j++)
+    {
+      BatchTerrain t;
+      t.job = &jobs[j];
+      t.bytes = batchJobBytes(jobs[j]);
+      budget.acquire(t.bytes);
+      t.terrain = generateTerrain(jobs[j].seed, jobs[j].size);
+      toCombine.push(t);
+    }
+    toCombine.close();
+  });
+
+  std::thread combiner([&]
+  {
+    BatchTerrain t;
+    while(toCombine.pop(t))
+    {
+      if(t.job->combine)
+        combineTerrain(t.terrain, t.job->size, t.job->seed, 1);
+      toErode.push(t);
+    }
+    toErode.close();
+  });
+
+  std::vector<std::thread> eroders;
+  for(int r = 0; r < runs; r++)
+  {
+    //the threads are shared out between the runs, the first ones taking any left over
+    int runThreads = erosionThreads / runs + (r < erosionThreads % runs ? 1 : 0);
+
+    eroders.push_back(std::thread([&, runThreads]
+    {
+      BatchTerrain t;
+      while(toErode.pop(t))
+      {
+        if(eroding(*t.job))
+        {
+          ErosionSettings erosion(t.job->erosion);
+          erosion.threads = runThreads;
+
+          float* eroded = erodeField(t.terrain, t.water, t.job->size, t.job->seed, erosion);
+          delete[] t.terrain;
+          t.terrain = eroded;
+          t.failed = eroded == NULL;
+        }
+        toWrite.push(t);
+      }
+    }));
+  }
+
+  //heightmaps are written in the background, so the next terrain's splat map is worked out meanwhile
+  std::mutex resultLock;
+  HeightmapExport exporter(1);
+
+  auto finishTerrain = [&](const BatchTerrain& t, bool ok)
+  {
+    {
+      std::lock_guard<std::mutex> guard(resultLock);
+      if(ok)
+        result.finished++;
+      else
+      {
+        result.failed++;
+        std::cout << (t.failed ? "Validation stopped the erosion of " : "Could not write ") << t.job->name << std::endl;
+      }
+    }
+
+    delete[] t.terrain;
+    delete[] t.water;
+    budget.release(t.bytes);
+  };
+
+  auto fileDone = [&](BatchWrite* w, bool ok)
+  {
+    bool last;
+    {
+      std::lock_guard<std::mutex> guard(resultLock);
+      w->ok = w->ok && ok;
+      last = --w->pending == 0;
+    }
+    if(last)
+    {
+      finishTerrain(w->terrain, w->ok);
+      delete w;
+    }
+  };
+
+  auto exportHeightmap = [&](BatchWrite* w, const std::string& name, const float* data)
+  {
+    const BatchJob& job = *w->terrain.job;
+    int file = exporter.open(name, job.size, job.size, job.format);
+    if(file < 0)
+    {
+      fileDone(w, false);
+      return;
+    }
+    exporter.writeRows(file, data, 0, job.size);
+    exporter.close(file, [=, &fileDone](bool ok) { fileDone(w, ok); });
+  };
+
+  std::thread writer([&]
+  {
+    BatchTerrain t;
+    while(toWrite.pop(t))
+    {
+      if(t.failed)
+      {
+        finishTerrain(t, false);
+        continue;
+      }
+
+      BatchWrite* w = new BatchWrite;
+      w->terrain = t;
+      w->pending = t.water != NULL ? 2 : 1;
+      w->ok = !t.job->splat || writeSplat(t);
+
+      const BatchJob& job = *t.job;
+      exportHeightmap(w, job.name + "." + job.extension, t.terrain);
+      if(t.water != NULL)
+        exportHeightmap(w, job.name + "-water." + job.extension, t.water);
+    }
+  });
+
+  generator.join();
+  combiner.join();
+  for(size_t r = 0; r < eroders.size(); r++)
+    eroders[r].join();
+  toWrite.close();
+  writer.join();
+  exporter.finish();
+
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return result;
+}
+
+//applies one key=value of a batch file line to a job
+bool applyBatchKey(BatchJob& job, const std::string& key, const std::string& value)
+{
+  float number = float(atof(value.c_str()));
+  ErosionParams& params = job.erosion.params;
+
+  if(key == "name")
+    job.name = value;
+  else if(key == "format")
+  {
+    if(!parseHeightmapFormat(value, job.format))
+      return false;
+    job.extension = value;
+  }
+  else if(key == "combine")
+    job.combine = atoi(value.c_str()) != 0;
+  else if(key == "splat")
+    job.splat = atoi(value.c_str()) != 0;
+  else if(key == "iterations")
+    job.erosion.iterations = atoi(value.c_str());
+  else if(key == "half")
+    job.erosion.halfPrecision = atoi(value.c_str()) != 0;
+  else if(key == "sparse")
+    job.erosion.sparseTileSize = atoi(value.c_str());
+  else if(key == "timeStep")
+    params.timeStep = number;
+  else if(key == "raindropSize")
+    params.raindropSize = number;
+  else if(key == "rainProbability")
+    params.rainProbability = number;
+  else if(key == "sedimentCapacity")
+    params.sedimentCapacity = number;
+  else if(key == "dissolveRate")
+    params.dissolveRate = number;
+  else if(key == "depositRate")
+    params.depositRate = number;
+  else if(key == "evaporationRate")
+    params.evaporationRate = number;
+  else
+    return false;
+  return true;
+}
+
+bool readBatchFile(const std::string& path, std::vector<BatchJob>& jobs)
+{
+  std::ifstream file(path);
+  if(!file)
+  {
+    std::cout << "Could not read " << path << std::endl;
+    return false;
+  }
+
+  std::string line;
+  for(int number = 1; std::getline(file, line); number++)
+  {
+    std::istringstream fields(line);
+    std::string seed;
+    if(!(fields >> seed) || seed[0] == '#')
+      continue;
+
+    BatchJob job;
+    job.seed = strtoull(seed.c_str(), NULL, 10);
+    bool ok = bool(fields >> job.size);
+
+    //sizes must be a power of two plus one, up to 2^30 + 1 so the shifts below cannot overflow
+    ok = ok && job.size >= 3 && job.size <= (1 << 30) + 1;
+    int iterations = 0;
+    while(ok && (1 << iterations) + 1 < job.size)
+      iterations++;
+    ok = ok && (1 << iterations) + 1 == job.size;
+
+    std::string setting;
+    while(ok && fields >> setting)
+    {
+      size_t split = setting.find('=');
+      ok = split != std::string::npos && applyBatchKey(job, setting.substr(0, split), setting.substr(split + 1));
+    }
+
+    if(!ok)
+    {
+      std::cout << path << " line " << number << ": expected seed size [key=value ...], got " << line << std::endl;
+      return false;
+    }
+
+    if(job.name.empty())
+      job.name = "terrain-" + seed + "-" + std::to_string(job.size);
+    jobs.push_back(job);
+  }
+  return true;
+}
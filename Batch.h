@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "Erosion.h"
+#include "imageio.h"
+
+//one terrain of a batch
+struct BatchJob
+{
+  BatchJob() : seed(0), size(1025), combine(false), format(HEIGHTMAP_PGM16), extension("pgm"), splat(false)
+  {
+    erosion.iterations = 0;
+  }
+
+  uint64_t seed;
+
+  //a power of two plus one
+  int size;
+
+  //adds the interpolated noise layers of combineTerrain() to the fractal
+  bool combine;
+
+  //iterations 0 skips erosion; threads is set by the batch
+  ErosionSettings erosion;
+
+  //files written: <name>.<extension>, <name>-water.<extension> if eroded, and with splat set
+  //<name>-splat.pam and <name>-normal.ppm (see genSplat())
+  std::string name;
+  HeightmapFormat format;
+  std::string extension;
+  bool splat;
+};
+
+struct BatchSettings
+{
+  BatchSettings() : threads(0), erosionRuns(1), memoryBudget(size_t(4) << 30) {}
+
+  //threads used, 0 uses every hardware thread
+  //generating, combining and writing run on a thread each, overlapped with the erosion of other terrains, and
+  //heightmaps are encoded and written by a HeightmapExport (one encoder and one I/O thread) behind the write stage;
+  //the other threads go to erosion, which takes nearly all the time, split evenly between erosionRuns terrains
+  //eroding at once, with at least one thread per run even if that goes over threads
+  int threads;
+  int erosionRuns;
+
+  //bytes of terrain state the batch may hold at once, as estimated by batchJobBytes(); a terrain is only
+  //started once its bytes fit, and one that does not fit at all waits to be the only one held
+  size_t memoryBudget;
+};
+
+struct BatchResult
+{
+  BatchResult() : finished(0), failed(0), seconds(0) {}
+
+  //terrains written, and terrains dropped because validation stopped their erosion or a file could not be written
+  int finished;
+  int failed;
+  double seconds;
+};
+
+//reads a batch file, one terrain per line: seed size [key=value ...]
+//keys: name (defaults to terrain-<seed>-<size>), format (pgm, float or u16), combine (0 or 1), splat (0 or 1),
+//iterations, half (0 or 1), sparse (tile size) and the ErosionParams
+//timeStep, raindropSize, rainProbability, sedimentCapacity, dissolveRate, depositRate and evaporationRate
+//blank lines and lines starting with # are skipped; returns false, naming the line on std::cout, on anything else
+bool readBatchFile(const std::string& path, std::vector<BatchJob>& jobs);
+
+//peak bytes held for a terrain while it moves through the batch
+size_t batchJobBytes(const BatchJob& job);
+
+//adds two layers of smooth noise to a terrain: a broad one interpolated up from 6 * 6 random heights, which also
+//scales the terrain (flattening it where the broad layer is low), and a finer one from 24 * 24
+void combineTerrain(float* terrain, int size, uint64_t seed, int threads);
+
+//runs every job through generate, combine, erode and write, with each stage working on a different terrain at once
+//a terrain that fails is reported on std::cout and the rest carry on
+BatchResult runBatch(const std::vector<BatchJob>& jobs, const BatchSettings& settings = BatchSettings());
@@ -1,130 +1,232 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
-#include <vector>
+#include <cfloat>
 #include <cmath>
+#include <limits>
+#include <vector>
 
-#include "mathfuncs.h"
 #include "Erosion.h"
+#include "ErosionCheckpoint.h"
+#include "ErosionGrid.h"
+#ifdef EROSION_TRACE
+#include "ErosionTrace.h"
+#endif
+#include "Heightfield.h"
+#include "mathfuncs.h"
+#include "ThreadPool.h"
+#include "simd.h"
+#include "random.h"
 
-const int ITERATIONS = 1000;
-const float TIME_STEP = 0.0002;
-const float RAINDROP_SIZE = 0.1;
-const float RAIN_PROB = 0.05;
-const float PIPE_CROSS_SECTION = 0.05;
-const float GRAVITY = 0.05;
-const float PIPE_LENGTH = 0.001;
-const float TILT_MIN = 0.0000;
-const float SEDIMENT_CAP = 0.07;
-const float DISSOLVE_COEFF = 0.0002;
-const float DEP_COEFF = 0.0008;
-const float EVAP_COEFF = 0.001;
-
-struct Crd
-{
-  Crd(){x = 0; y = 0;}
-  Crd(int i, int j){x = i; y = j;}
-
-  int x;
-  int y;
-};
-
-struct Cell
-{
-  float b;
-  float b1;
-  float prevD;
-  float d;
-  float d1;
-  float d2;
-  float s;
-  float s1;
-  float f[4];
-  float u;
-  float v;
-};
+const int BANDS_PER_THREAD = 4;
 
 const int LEFT = 0;
 const int RIGHT = 1;
 const int TOP = 2;
 const int BOTTOM = 3;
 
-void checkStability(Cell& c)
-{
-  bool unDef = false;
-
-  unDef = (unDef || std::isnan(c.b) || std::isinf(c.b));
-  unDef = (unDef || std::isnan(c.prevD) || std::isinf(c.prevD));
-  unDef = (unDef || std::isnan(c.d) || std::isinf(c.d));
-  unDef = (unDef || std::isnan(c.s) || std::isinf(c.s));
-  unDef = (unDef || std::isnan(c.f[0]) || std::isinf(c.f[0]));
-  unDef = (unDef || std::isnan(c.f[1]) || std::isinf(c.f[1]));
-  unDef = (unDef || std::isnan(c.f[2]) || std::isinf(c.f[2]));
-  unDef = (unDef || std::isnan(c.f[3]) || std::isinf(c.f[3]));
-  unDef = (unDef || std::isnan(c.u) || std::isinf(c.u));
-  unDef = (unDef || std::isnan(c.v) || std::isinf(c.v));
-  unDef = (unDef || abs(c.f[0]) > 10000);
-  unDef = (unDef || abs(c.f[1]) > 10000);
-  unDef = (unDef || abs(c.f[2]) > 10000);
-  unDef = (unDef || abs(c.f[3]) > 10000);
-  unDef = (unDef || c.d < 0.0);
-  unDef = (unDef || c.b < -1);
-
-  if(unDef)
-  {
-    std::cout << "Listing Diagnostic:" << std::endl;
-    std::cout << c.b << std::endl;
-    std::cout << c.d1 << std::endl;
-    std::cout << c.d2 << std::endl;
-    std::cout << c.d << std::endl;
-    std::cout << c.s << std::endl;
-    std::cout << c.f[0] << std::endl;
-    std::cout << c.f[1] << std::endl;
-    std::cout << c.f[2] << std::endl;
-    std::cout << c.f[3] << std::endl;
-    std::cout << c.u << std::endl;
-    std::cout << c.v << std::endl;
-
-    exit(-1);
-  }
-}
-
-Crd getCoordAtDir(Crd c, int dir, int size, bool& isNull)
-{
-  Crd val;
-  isNull = false;
-
-  if(dir == LEFT)
-    val = Crd(c.x - 1, c.y);
-  else if(dir == RIGHT)
-    val = Crd(c.x + 1, c.y);
-  else if(dir == TOP)
-    val = Crd(c.x, c.y + 1);
-  else if(dir == BOTTOM)
-    val = Crd(c.x, c.y - 1);
-  else
-    isNull = true;
+//a state plane as seen by the kernels built for one way of holding it: T is float, or uint16_t for half planes
+//(see ErosionGrid::halfPrecision), and every kernel touching sediment, flux or velocity is built for both
+template<class T>
+struct StateView
+{
+  explicit StateView(const StatePlane& plane) : data(plane.data<T>()), scale(plane.scale), invScale(1 / plane.scale) {}
 
-  //check for out of bounds
-  if(val.x < 0 || val.x >= size || val.y < 0 || val.y >= size)
-	 isNull = true;
-  else
-    return val;
+  T* data;
+  float scale;
+  float invScale;
+};
+
+//state values are always worked on as floats
+//float planes skip the scale, so float runs do exactly the arithmetic they did before half planes existed
+template<class Ops>
+typename Ops::V loadState(const StateView<float>& plane, ptrdiff_t i)
+{
+  return Ops::load(plane.data + i);
 }
 
-int getOppositeDirection(int dir)
+template<class Ops>
+typename Ops::V loadState(const StateView<uint16_t>& plane, ptrdiff_t i)
 {
-  if(dir == LEFT)
-    return RIGHT;
-  else if(dir == RIGHT)
-    return LEFT;
-  else if(dir == TOP)
-    return BOTTOM;
-  else if(dir == BOTTOM)
-    return TOP;
-  else
-    return -1;
+  return Ops::mul(Ops::load(plane.data + i), Ops::set(plane.invScale));
+}
+
+template<class Ops>
+void storeState(const StateView<float>& plane, ptrdiff_t i, typename Ops::V a)
+{
+  Ops::store(plane.data + i, a);
+}
+
+template<class Ops>
+void storeState(const StateView<uint16_t>& plane, ptrdiff_t i, typename Ops::V a)
+{
+  Ops::store(plane.data + i, Ops::mul(a, Ops::set(plane.scale)));
+}
+
+//range checks on the simulation state: every value finite, water never negative, terrain above -1
+//and no flux over 10000
+//Steps 3 and 5 write d2, b1 and s1, none of which is checked, so checking b, d (d1 by then), s and f after Step 2
+//and u and v after Step 4 catches every failure at the same point as checking everything after Steps 2 to 5
+const int CHECK_AFTER_FLUX = 1;
+const int CHECK_AFTER_VELOCITY = 2;
+
+const float MAX_FLUX = 10000;
+const float MIN_TERRAIN = -1;
+
+//first cell in [x0, x1) of row y failing the checks, or x1 if none does
+template<class Ops, class T>
+int firstInvalid(const ErosionGrid& g, int y, int x0, int x1, int checks)
+{
+  typedef typename Ops::V V;
+  typedef typename Ops::Mask Mask;
+  const V infinity = Ops::set(std::numeric_limits<float>::infinity());
+  const V zero = Ops::set(0.0f);
+  const V maxFlux = Ops::set(MAX_FLUX);
+  const V minTerrain = Ops::set(MIN_TERRAIN);
+  StateView<T> s(g.s), u(g.u), v(g.v);
+  StateView<T> f[4] = {StateView<T>(g.f[0]), StateView<T>(g.f[1]), StateView<T>(g.f[2]), StateView<T>(g.f[3])};
+
+  for(int x = x0; x + Ops::width <= x1; x += Ops::width)
+  {
+    ptrdiff_t i = g.index(x, y);
+    Mask ok;
+
+    //NaN fails every comparison
+    if(checks == CHECK_AFTER_FLUX)
+    {
+      V b = Ops::load(g.b + i);
+      V d = Ops::load(g.d + i);
+      ok = Ops::both(Ops::greaterEqual(b, minTerrain), Ops::less(b, infinity));
+      ok = Ops::both(ok, Ops::both(Ops::greaterEqual(d, zero), Ops::less(d, infinity)));
+      ok = Ops::both(ok, Ops::less(Ops::abs(loadState<Ops>(s, i)), infinity));
+      for(int k = 0; k < 4; k++)
+        ok = Ops::both(ok, Ops::lessEqual(Ops::abs(loadState<Ops>(f[k], i)), maxFlux));
+    }
+    else
+    {
+      ok = Ops::both(Ops::less(Ops::abs(loadState<Ops>(u, i)), infinity), Ops::less(Ops::abs(loadState<Ops>(v, i)), infinity));
+    }
+
+    if(!Ops::allTrue(ok))
+      return Ops::width == 1 ? x : firstInvalid<ScalarOps, T>(g, y, x, x + Ops::width, checks);
+  }
+  return x1;
+}
+
+//end of the whole vectors in cells [x0, x1) of a row
+//x0 is always a multiple of the vector width, so every cell takes the same path however the row is split up
+int vectorEnd(int x0, int x1)
+{
+  return x1 - (x1 - x0) % VectorOps::width;
 }
 
+template<class T>
+int firstInvalidInSpan(const ErosionGrid& g, int y, int x0, int x1, int checks)
+{
+  int end = vectorEnd(x0, x1);
+  int x = firstInvalid<VectorOps, T>(g, y, x0, end, checks);
+  if(x < end)
+    return x;
+  return firstInvalid<ScalarOps, T>(g, y, end, x1, checks);
+}
+
+//validation of one iteration, each band keeps the first bad cell it finds
+struct StabilityCheck
+{
+  struct Failure
+  {
+    Failure() : x(-1), y(-1), step(0) {}
+    int x;
+    int y;
+    int step;
+  };
+
+  //one slot per band, or per tile in sparse runs
+  StabilityCheck(int slotCount) : enabled(false), failed(false), failures(slotCount) {}
+
+  //checks cells [x0, x1) of rows [y0, y1) of band or tile j after step (STEP_FLUX or STEP_VELOCITY)
+  void cells(const ErosionGrid& g, int j, int x0, int x1, int y0, int y1, int step)
+  {
+    if(!enabled || failures[j].y >= 0)
+      return;
+
+    int checks = step == STEP_FLUX ? CHECK_AFTER_FLUX : CHECK_AFTER_VELOCITY;
+    for(int y = y0; y < y1; y++)
+    {
+      int x = g.halfPrecision ? firstInvalidInSpan<uint16_t>(g, y, x0, x1, checks) : firstInvalidInSpan<float>(g, y, x0, x1, checks);
+      if(x < x1)
+      {
+        failures[j].x = x;
+        failures[j].y = y;
+        failures[j].step = step;
+        failed = true;
+        return;
+      }
+    }
+  }
+
+  //fills in the first bad cell in slot order, once every band is past the step that found it
+  void report(const ErosionGrid& g, int iteration, ErosionError& error) const
+  {
+    for(size_t j = 0; j < failures.size(); j++)
+    {
+      if(failures[j].y < 0)
+        continue;
+
+      ptrdiff_t i = g.index(failures[j].x, failures[j].y);
+      error.x = failures[j].x;
+      error.y = failures[j].y;
+      error.iteration = iteration;
+      error.step = failures[j].step;
+      error.b = g.b[i];
+      error.d1 = g.d[i];
+      error.d2 = g.d2[i];
+      error.s = g.s.get(i);
+      for(int k = 0; k < 4; k++)
+        error.f[k] = g.f[k].get(i);
+      error.u = g.u.get(i);
+      error.v = g.v.get(i);
+      return;
+    }
+  }
+
+  //validate this iteration
+  bool enabled;
+
+  //set by any band that finds a bad cell
+  std::atomic<bool> failed;
+
+  std::vector<Failure> failures;
+};
+
+//chance of rain on a cell per iteration as a threshold on 32 random bits,
+//the same 1 in int(size * size * probability) odds as the old rand() test
+uint32_t rainThreshold(int size, float probability)
+{
+  long long period = std::max(1LL, (long long)(double(size) * size * probability));
+  return uint32_t(std::min<uint64_t>(0xFFFFFFFF, (uint64_t(1) << 32) / period));
+}
+
+//ErosionParams as the kernels use them, with the products they need worked out once per run
+struct ErosionConstants
+{
+  ErosionConstants(const ErosionParams& params, int size)
+    : params(params), rainThreshold(::rainThreshold(size, params.rainProbability)),
+      fluxRate(params.timeStep * params.pipeCrossSection * params.gravity),
+      pipeArea(params.pipeLength * params.pipeLength), evaporation(1 - (params.evaporationRate * params.timeStep)) {}
+
+  ErosionParams params;
+  uint32_t rainThreshold;
+
+  //flux gained per unit of height difference, before dividing by the pipe length
+  float fluxRate;
+  float pipeArea;
+
+  //water left after evaporating for one time step
+  float evaporation;
+};
+
 float getInterpValue(float ll, float lr, float ul, float ur, float x, float y)
 {
   float lLerp = x * (lr - ll) + ll;
@@ -132,351 +234,1222 @@ float getInterpValue(float ll, float lr, float ul, float ur, float x, float y)
   return y * (uLerp - lLerp) + lLerp;
 }
 
-float* erodeField(float* field, float*& water, int size)
+//Step 1 for row y
+//every cell draws from (seed, iteration, x, y), so rows can be rained on in any order on any thread
+void rainRow(ErosionGrid& g, const ErosionConstants& c, int y, uint64_t seed, int iteration)
 {
-  Cell defaultCell;
-  defaultCell.b = 0.0f;
-  defaultCell.b1 = 0.0f;
-  defaultCell.d = 0.0f;
-  defaultCell.d1 = 0.0f;
-  defaultCell.d2 = 0.0f;
-  defaultCell.s = 0.0f;
-  defaultCell.s1 = 0.0f;
-  defaultCell.f[0] = {0.0f};
-  defaultCell.f[1] = { 0.0f };
-  defaultCell.f[2] = { 0.0f };
-  defaultCell.f[3] = { 0.0f };
-  defaultCell.u = 0.0f;
-  defaultCell.v = 0.0f;
+  float* d = g.d + g.index(0, y);
+  uint32_t threshold = c.rainThreshold;
+  int x = 0;
 
-  //create 2D map of cells
-  std::vector<std::vector<Cell>> sim(size, std::vector<Cell>(size, defaultCell));
+#if defined(__AVX2__)
+  //AVX2 only compares signed integers, so flip the top bit of both sides first
+  const __m256i flip = _mm256_set1_epi32(int(0x80000000));
+  const __m256i limit = _mm256_xor_si256(_mm256_set1_epi32(int(threshold)), flip);
+  const __m256 drop = _mm256_set1_ps(c.params.raindropSize);
 
-  //Set terrain height to values stored in field
-  for(int x = 0; x < size; x++)
+  for(; x + 8 <= g.size; x += 8)
   {
-    for(int y = 0; y < size; y++)
+    __m256i bits = _mm256_xor_si256(randomBits8(seed, RANDOM_RAIN, iteration, x, y), flip);
+    __m256 raining = _mm256_castsi256_ps(_mm256_cmpgt_epi32(limit, bits));
+    __m256 water = _mm256_loadu_ps(d + x);
+    _mm256_storeu_ps(d + x, _mm256_blendv_ps(water, _mm256_add_ps(water, drop), raining));
+  }
+#endif
+
+  for(; x < g.size; x++)
+  {
+    bool raining = randomBits(seed, RANDOM_RAIN, iteration, x, y) < threshold;
+    d[x] = raining ? d[x] + c.params.raindropSize : d[x];
+  }
+}
+
+//Step 1: Add water through rainfall
+//rains on d in place, turning it into d1
+void stepRainfall(ErosionGrid& g, const ErosionConstants& c, int y0, int y1, uint64_t seed, int iteration)
+{
+  for(int y = y0; y < y1; y++)
+    rainRow(g, c, y, seed, iteration);
+}
+
+//Steps 2 to 4 run over whole rows Ops::width cells at a time with no per-cell branches
+//cells past the edge are ghost cells: b holds a wall of height FLT_MAX and f holds zero,
+//so flux out of the grid clamps to zero and flux into it is zero, as if the neighbour were skipped
+
+//Step 2 on cells [x0, x1) of row y
+template <class Ops, class T>
+void fluxSpan(ErosionGrid& g, const ErosionConstants& c, int y, int x0, int x1)
+{
+  typedef typename Ops::V V;
+
+  StateView<T> f[4] = {StateView<T>(g.f[0]), StateView<T>(g.f[1]), StateView<T>(g.f[2]), StateView<T>(g.f[3])};
+  const float* bRow = g.b + g.index(0, y);
+  const float* d1Row = g.d + g.index(0, y);
+  const float* bSide[4] = {bRow - 1, bRow + 1, bRow + g.stride, bRow - g.stride};
+  const float* d1Side[4] = {d1Row - 1, d1Row + 1, d1Row + g.stride, d1Row - g.stride};
+  const V zero = Ops::set(0.0f);
+  const V one = Ops::set(1.0f);
+  const V fluxRate = Ops::set(c.fluxRate);
+  const V pipeLength = Ops::set(c.params.pipeLength);
+  const V pipeArea = Ops::set(c.pipeArea);
+  const V timeStep = Ops::set(c.params.timeStep);
+  //0.000001 rounds down as a float, so comparing floats gives the same answer as comparing doubles
+  const V minFlux = Ops::set(0.000001f);
+
+  for(int x = x0; x < x1; x += Ops::width)
+  {
+    ptrdiff_t i = g.index(x, y);
+    V height = Ops::add(Ops::load(bRow + x), Ops::load(d1Row + x));
+    V fluxSum = zero;
+    V flux[4];
+
+    //for each direction
+    for(int j = 0; j < 4; j++)
     {
-      sim[x][y].b = field[coord(x, y, size)];
+      //calculate height difference (including water)
+      V deltaHeight = Ops::sub(height, Ops::add(Ops::load(bSide[j] + x), Ops::load(d1Side[j] + x)));
+
+      //find new flux value for direction
+      flux[j] = Ops::vmax(Ops::add(loadState<Ops>(f[j], i), Ops::div(Ops::mul(fluxRate, deltaHeight), pipeLength)), zero);
+      fluxSum = Ops::add(fluxSum, flux[j]);
     }
+
+    V scalingFactor = Ops::select(Ops::greater(fluxSum, minFlux), Ops::div(pipeArea, Ops::mul(fluxSum, timeStep)), one);
+    scalingFactor = Ops::vmax(zero, Ops::vmin(Ops::mul(scalingFactor, Ops::load(d1Row + x)), one));
+
+    //adjust based on scaling factor
+    for(int j = 0; j < 4; j++)
+      storeState<Ops>(f[j], i, Ops::mul(flux[j], scalingFactor));
   }
+}
 
-  //main loop
-  for(int i = 0; i < ITERATIONS; i++)
+//Step 3 on cells [x0, x1) of row y
+template <class Ops, class T>
+void applyFluxSpan(ErosionGrid& g, const ErosionConstants& c, int y, int x0, int x1)
+{
+  typedef typename Ops::V V;
+
+  StateView<T> f[4] = {StateView<T>(g.f[0]), StateView<T>(g.f[1]), StateView<T>(g.f[2]), StateView<T>(g.f[3])};
+  const ptrdiff_t offset[4] = {-1, 1, g.stride, -g.stride};
+  const int opposite[4] = {RIGHT, LEFT, BOTTOM, TOP};
+  const V zero = Ops::set(0.0f);
+  const V pipeArea = Ops::set(c.pipeArea);
+  const V timeStep = Ops::set(c.params.timeStep);
+
+  for(int x = x0; x < x1; x += Ops::width)
   {
-    //std::cout << "Iteration " << i << std::endl;
+    ptrdiff_t i = g.index(x, y);
+    V totalDelta = zero;
 
-    //Step 1: Add water through rainfall
-    for(int x = 0; x < size; x++)
+    for(int j = 0; j < 4; j++)
     {
-      for(int y = 0; y < size; y++)
-      {
-        if(rand() % int(size * size * RAIN_PROB) == 0)
-        {
-          sim[x][y].d1 = sim[x][y].d + RAINDROP_SIZE;
-        }
-        else
-        {
-          sim[x][y].d1 = sim[x][y].d;
-        }
-      }
+      //inflow
+      totalDelta = Ops::add(totalDelta, loadState<Ops>(f[opposite[j]], i + offset[j]));
+      //outflow
+      totalDelta = Ops::sub(totalDelta, loadState<Ops>(f[j], i));
     }
 
-    //Step 2: Calculate movement of water
-    for(int x = 0; x < size; x++)
+    V water = Ops::add(Ops::load(g.d + i), Ops::div(Ops::mul(timeStep, totalDelta), pipeArea));
+    Ops::store(g.d2 + i, Ops::vmax(zero, water));
+  }
+}
+
+//Step 4 on cells [x0, x1) of row y
+template <class Ops, class T>
+void velocitySpan(ErosionGrid& g, const ErosionConstants& c, int y, int x0, int x1)
+{
+  typedef typename Ops::V V;
+
+  StateView<T> f[4] = {StateView<T>(g.f[0]), StateView<T>(g.f[1]), StateView<T>(g.f[2]), StateView<T>(g.f[3])};
+  StateView<T> uPlane(g.u), vPlane(g.v);
+  const ptrdiff_t stride = g.stride;
+  const V zero = Ops::set(0.0f);
+  const V two = Ops::set(2.0f);
+  const V pipeLength = Ops::set(c.params.pipeLength);
+  //0.0000001 rounds up as a float, so >= on floats matches > on doubles
+  const V minWater = Ops::set(0.0000001f);
+
+  for(int x = x0; x < x1; x += Ops::width)
+  {
+    ptrdiff_t i = g.index(x, y);
+    V avgWater = Ops::div(Ops::add(Ops::load(g.d2 + i), Ops::load(g.d + i)), two);
+    typename Ops::Mask wet = Ops::greaterEqual(avgWater, minWater);
+    V depth = Ops::mul(avgWater, pipeLength);
+
+    //horizontal side
+    V lContrib = Ops::sub(loadState<Ops>(f[RIGHT], i - 1), loadState<Ops>(f[LEFT], i));
+    V rContrib = Ops::sub(loadState<Ops>(f[RIGHT], i), loadState<Ops>(f[LEFT], i + 1));
+    V u = Ops::div(Ops::div(Ops::add(lContrib, rContrib), two), depth);
+    storeState<Ops>(uPlane, i, Ops::select(wet, u, zero));
+
+    //vertical side
+    V bContrib = Ops::sub(loadState<Ops>(f[TOP], i - stride), loadState<Ops>(f[BOTTOM], i));
+    V tContrib = Ops::sub(loadState<Ops>(f[TOP], i), loadState<Ops>(f[BOTTOM], i + stride));
+    V v = Ops::div(Ops::div(Ops::add(bContrib, tContrib), two), depth);
+    storeState<Ops>(vPlane, i, Ops::select(wet, v, zero));
+  }
+}
+
+//every step from here on runs over cells [x0, x1) of rows [y0, y1): whole rows for bands, or one tile
+
+template<class T>
+void fluxRows(ErosionGrid& g, const ErosionConstants& c, int x0, int x1, int y0, int y1)
+{
+  int end = vectorEnd(x0, x1);
+
+  for(int y = y0; y < y1; y++)
+  {
+    fluxSpan<VectorOps, T>(g, c, y, x0, end);
+    fluxSpan<ScalarOps, T>(g, c, y, end, x1);
+  }
+}
+
+//Step 2: Calculate movement of water
+//reads b, d1, writes f
+void stepFlux(ErosionGrid& g, const ErosionConstants& c, int x0, int x1, int y0, int y1)
+{
+  if(g.halfPrecision)
+    fluxRows<uint16_t>(g, c, x0, x1, y0, y1);
+  else
+    fluxRows<float>(g, c, x0, x1, y0, y1);
+}
+
+template<class T>
+void applyFluxRows(ErosionGrid& g, const ErosionConstants& c, int x0, int x1, int y0, int y1)
+{
+  int end = vectorEnd(x0, x1);
+
+  for(int y = y0; y < y1; y++)
+  {
+    applyFluxSpan<VectorOps, T>(g, c, y, x0, end);
+    applyFluxSpan<ScalarOps, T>(g, c, y, end, x1);
+  }
+}
+
+//Step 3: Apply calculated flux amounts
+//reads d1, f, writes d2
+void stepApplyFlux(ErosionGrid& g, const ErosionConstants& c, int x0, int x1, int y0, int y1)
+{
+  if(g.halfPrecision)
+    applyFluxRows<uint16_t>(g, c, x0, x1, y0, y1);
+  else
+    applyFluxRows<float>(g, c, x0, x1, y0, y1);
+}
+
+template<class T>
+void velocityRows(ErosionGrid& g, const ErosionConstants& c, int x0, int x1, int y0, int y1)
+{
+  int end = vectorEnd(x0, x1);
+
+  for(int y = y0; y < y1; y++)
+  {
+    velocitySpan<VectorOps, T>(g, c, y, x0, end);
+    velocitySpan<ScalarOps, T>(g, c, y, end, x1);
+  }
+}
+
+//Step 4: Adjust velocity field
+//reads d1, d2, f, writes u, v
+void stepVelocity(ErosionGrid& g, const ErosionConstants& c, int x0, int x1, int y0, int y1)
+{
+  if(g.halfPrecision)
+    velocityRows<uint16_t>(g, c, x0, x1, y0, y1);
+  else
+    velocityRows<float>(g, c, x0, x1, y0, y1);
+}
+
+//Steps 5 and 6 work cell by cell on floats: on half grids they are handed u, v and s a chunk of a row at a time,
+//converted a whole vector at a time, and float grids hand them their rows in place
+const int STATE_CHUNK = 256;
+
+//converts count cells of a half state plane from cell i on to floats and back
+void readHalfState(const StatePlane& plane, ptrdiff_t i, int count, float* values)
+{
+  StateView<uint16_t> view(plane);
+  int x = 0;
+  for(; x + VectorOps::width <= count; x += VectorOps::width)
+    VectorOps::store(values + x, loadState<VectorOps>(view, i + x));
+  for(; x < count; x++)
+    values[x] = loadState<ScalarOps>(view, i + x);
+}
+
+void writeHalfState(const StatePlane& plane, ptrdiff_t i, int count, const float* values)
+{
+  StateView<uint16_t> view(plane);
+  int x = 0;
+  for(; x + VectorOps::width <= count; x += VectorOps::width)
+    storeState<VectorOps>(view, i + x, VectorOps::load(values + x));
+  for(; x < count; x++)
+    storeState<ScalarOps>(view, i + x, values[x]);
+}
+
+//height difference across a cell along one axis, from the neighbours step cells before and after it
+//FIRST and LAST say the cell is on that edge of the grid, where the missing neighbour's half is taken to
+//match the other half (doubling it); interior cells are built with both false and test nothing
+template<bool FIRST, bool LAST>
+float heightDelta(const float* b, ptrdiff_t i, ptrdiff_t step)
+{
+  float delta = 0.0;
+  if(!FIRST)
+    delta += b[i] - b[i - step];
+  if(!LAST)
+    delta += b[i + step] - b[i];
+
+  //adjust for boundary condition
+  if(FIRST || LAST)
+    delta *= 2;
+  return delta;
+}
+
+//sine of the terrain slope at cell i, on the edges of the grid given by the template arguments
+template<bool FIRST_X, bool LAST_X, bool FIRST_Y, bool LAST_Y>
+float slopeAt(const ErosionGrid& g, const ErosionConstants& c, ptrdiff_t i)
+{
+  //find tilt angle
+  float hHeightDelta = heightDelta<FIRST_X, LAST_X>(g.b, i, 1);
+  float vHeightDelta = heightDelta<FIRST_Y, LAST_Y>(g.b, i, g.stride);
+
+  //find normal (and normalize)
+  float normal[3] = {hHeightDelta, c.params.pipeLength, vHeightDelta};
+  float magnitude = sqrt(pow(normal[0], 2) + pow(normal[1], 2) + pow(normal[2], 2));
+  normal[0] /= magnitude;
+  normal[1] /= magnitude;
+  normal[2] /= magnitude;
+
+  return std::max(c.params.tiltMin, float(sqrt(1.0 - pow(normal[1], 2))));
+}
+
+//Step 5 for cell i, on the edges of the grid given by the template arguments
+//the slope only changes where the terrain has, so it is taken from the last iteration unless marked dirty
+template<bool FIRST_X, bool LAST_X, bool FIRST_Y, bool LAST_Y>
+void erodeDepositCell(ErosionGrid& g, const ErosionConstants& c, ptrdiff_t i, float u, float v, float sediment)
+{
+  if(g.slopeDirty[i])
+  {
+    g.slope[i] = slopeAt<FIRST_X, LAST_X, FIRST_Y, LAST_Y>(g, c, i);
+    g.slopeDirty[i] = 0;
+  }
+  float sinOfAngle = g.slope[i];
+
+  float velMagnitude = sqrt(pow(u, 2) + pow(v, 2));
+
+  float transCapacity = c.params.sedimentCapacity * sinOfAngle * velMagnitude;
+
+  if(transCapacity > sediment)
+  {
+    //erode
+    float sedChange = c.params.dissolveRate * (transCapacity - sediment);
+
+    g.b1[i] = std::max(0.0f, g.b[i] - sedChange);
+    g.s1[i] = sediment + sedChange;
+  }
+  else
+  {
+    //deposit
+    float sedChange = c.params.depositRate * (sediment - transCapacity);
+
+    g.b1[i] = g.b[i] + sedChange;
+    g.s1[i] = std::max(0.0f, sediment - sedChange);
+  }
+}
+
+//Step 5 on cells [x0, x1) of a row on the edges given by FIRST_Y and LAST_Y
+//the first and last cell of the grid's rows get their own builds, the cells in between run the interior one
+template<bool FIRST_Y, bool LAST_Y>
+void erodeDepositRow(ErosionGrid& g, const ErosionConstants& c, int y, int x0, int x1, const float* u, const float* v, const float* s)
+{
+  int size = g.size;
+  ptrdiff_t i0 = g.index(x0, y);
+  int x = x0;
+
+  if(x == 0 && x < x1)
+  {
+    if(size == 1)
+      erodeDepositCell<true, true, FIRST_Y, LAST_Y>(g, c, i0, u[0], v[0], s[0]);
+    else
+      erodeDepositCell<true, false, FIRST_Y, LAST_Y>(g, c, i0, u[0], v[0], s[0]);
+    x++;
+  }
+
+  int interiorEnd = std::min(x1, size - 1);
+  for(; x < interiorEnd; x++)
+    erodeDepositCell<false, false, FIRST_Y, LAST_Y>(g, c, i0 + (x - x0), u[x - x0], v[x - x0], s[x - x0]);
+
+  if(x < x1)
+    erodeDepositCell<false, true, FIRST_Y, LAST_Y>(g, c, i0 + (x - x0), u[x - x0], v[x - x0], s[x - x0]);
+}
+
+//Step 5 on cells [x0, x1) of row y, with u, v and s of those cells from u[0], v[0] and s[0] on
+void erodeDepositSpan(ErosionGrid& g, const ErosionConstants& c, int y, int x0, int x1, const float* u, const float* v, const float* s)
+{
+  if(g.size == 1)
+    erodeDepositRow<true, true>(g, c, y, x0, x1, u, v, s);
+  else if(y == 0)
+    erodeDepositRow<true, false>(g, c, y, x0, x1, u, v, s);
+  else if(y == g.size - 1)
+    erodeDepositRow<false, true>(g, c, y, x0, x1, u, v, s);
+  else
+    erodeDepositRow<false, false>(g, c, y, x0, x1, u, v, s);
+}
+
+//Step 5: Erode and Deposit
+//reads b, s, u, v, slope, writes b1, s1, and slope where it is dirty
+void stepErodeDeposit(ErosionGrid& g, const ErosionConstants& c, int x0, int x1, int y0, int y1)
+{
+  for(int y = y0; y < y1; y++)
+  {
+    if(!g.halfPrecision)
     {
-      for(int y = 0; y < size; y++)
-      {
-        float fluxSum = 0.0;
-        //for each direction
-        for(int j = 0; j < 4; j++)
-        {
-          //get adjacent cell at direction
-    			bool n;
-    			Crd side = getCoordAtDir(Crd(x, y), j, size, n);
-
-          if(!n)
-          {
-            //calculate height difference (including water)
-            float deltaHeight = (sim[x][y].b + sim[x][y].d1) - (sim[side.x][side.y].b + sim[side.x][side.y].d1);
-
-            //find new flux value for direction
-            sim[x][y].f[j] = std::max(0.0f, sim[x][y].f[j] + (TIME_STEP * PIPE_CROSS_SECTION * GRAVITY * deltaHeight) / PIPE_LENGTH);
-          }
-          else
-          {
-            sim[x][y].f[j] = 0.0;
-          }
-
-          fluxSum += sim[x][y].f[j];
-        }
-
-        float scalingFactor = 1.0f;
-        if(fluxSum > 0.000001)
-          scalingFactor = (PIPE_LENGTH * PIPE_LENGTH) / (fluxSum * TIME_STEP);
-
-        scalingFactor = std::max(std::min(1.0f, scalingFactor * sim[x][y].d1), 0.0f);
-
-        //for each direction
-        for(int j = 0; j < 4; j++)
-        {
-          //adjust based on scaling factor
-          sim[x][y].f[j] *= scalingFactor;
-        }
-
-        checkStability(sim[x][y]);
-      }
+      ptrdiff_t i = g.index(x0, y);
+      erodeDepositSpan(g, c, y, x0, x1, g.u.full + i, g.v.full + i, g.s.full + i);
+      continue;
     }
 
-    //Step 3: Apply calculated flux amounts
-    for(int x = 0; x < size; x++)
+    for(int x = x0; x < x1; x += STATE_CHUNK)
     {
-      for(int y = 0; y < size; y++)
-      {
-        float totalDelta = 0.0;
-
-        for(int j = 0; j < 4; j++)
-        {
-    			bool n;
-    			Crd side = getCoordAtDir(Crd(x, y), j, size, n);
-          if(!n)
-          {
-            //inflow
-            totalDelta += sim[side.x][side.y].f[getOppositeDirection(j)];
-            //outflow
-            totalDelta -= sim[x][y].f[j];
-          }
-        }
-
-        sim[x][y].d2 = sim[x][y].d1 + ((TIME_STEP * totalDelta) / (PIPE_LENGTH * PIPE_LENGTH));
-
-        if(sim[x][y].d2 < 0.000001)
-        {
-          if(sim[x][y].d2 < 0.0)
-            sim[x][y].d2 = 0.0;
-        }
-
-        checkStability(sim[x][y]);
-      }
+      float u[STATE_CHUNK], v[STATE_CHUNK], s[STATE_CHUNK];
+      int count = std::min(STATE_CHUNK, x1 - x);
+      ptrdiff_t i = g.index(x, y);
+      readHalfState(g.u, i, count, u);
+      readHalfState(g.v, i, count, v);
+      readHalfState(g.s, i, count, s);
+      erodeDepositSpan(g, c, y, x, x + count, u, v, s);
     }
+  }
+}
+
+//Step 6 on cells [x0, x1) of row y, with u, v and s of those cells from u[0], v[0] and s[0] on
+void transportSpan(ErosionGrid& g, const ErosionConstants& c, int y, int x0, int x1, const float* u, const float* v, float* s)
+{
+  int size = g.size;
+  ptrdiff_t stride = g.stride;
 
-    //Step 4: Adjust velocity field
-    for(int x = 0; x < size; x++)
+  for(int x = x0; x < x1; x++)
+  {
+    float xSed = x - (u[x - x0] * c.params.timeStep);
+    float ySed = y - (v[x - x0] * c.params.timeStep);
+    int xDown = floor(xSed);
+    int yDown = floor(ySed);
+
+    if(xDown >= size - 1 || xDown < 0 || yDown >= size - 1 || yDown < 0)
     {
-      for(int y = 0; y < size; y++)
-      {
-        float avgWater = (sim[x][y].d2 + sim[x][y].d1) / 2.0f;
-
-        //horizontal side
-        float lContrib = 0.0;
-    		bool l;
-    		Crd lSide = getCoordAtDir(Crd(x, y), LEFT, size, l);
-        if(!l)
-        {
-          lContrib = sim[lSide.x][lSide.y].f[RIGHT] - sim[x][y].f[LEFT];
-        }
-
-        float rContrib = 0.0;
-    		bool r;
-    		Crd rSide = getCoordAtDir(Crd(x, y), RIGHT, size, r);
-        if(!r)
-        {
-          rContrib = sim[x][y].f[RIGHT] - sim[rSide.x][rSide.y].f[LEFT];
-        }
-
-        if(avgWater > 0.0000001)
-        {
-          sim[x][y].u = ((lContrib + rContrib) / 2.0) / (avgWater * PIPE_LENGTH);
-        }
-        else
-        {
-          sim[x][y].u = 0.0;
-        }
-
-        //vertical side
-        float bContrib = 0.0;
-    		bool b;
-    		Crd bSide = getCoordAtDir(Crd(x, y), BOTTOM, size, b);
-        if(!b)
-        {
-          bContrib = sim[bSide.x][bSide.y].f[TOP] - sim[x][y].f[BOTTOM];
-        }
-
-        float tContrib = 0.0;
-    		bool t;
-    		Crd tSide = getCoordAtDir(Crd(x, y), TOP, size, t);
-        if(!t)
-        {
-          tContrib = sim[x][y].f[TOP] - sim[tSide.x][tSide.y].f[BOTTOM];
-        }
-
-        if(avgWater > 0.0000001)
-          sim[x][y].v = ((bContrib + tContrib) / 2.0) / (avgWater * PIPE_LENGTH);
-        else
-          sim[x][y].v = 0.0;
+      //do not move sediment
+    }
+    else
+    {
+      const float* s1 = &g.s1[g.index(xDown, yDown)];
+      s[x - x0] = getInterpValue(s1[0], s1[1], s1[stride], s1[stride + 1], xSed - xDown, ySed - yDown);
+    }
+  }
+}
 
-        checkStability(sim[x][y]);
-      }
+//Step 6: Transport Sediment
+//reads s1, u, v, writes s
+//sediment that does not move is converted back to the half it came from
+void stepTransport(ErosionGrid& g, const ErosionConstants& c, int x0, int x1, int y0, int y1)
+{
+  for(int y = y0; y < y1; y++)
+  {
+    if(!g.halfPrecision)
+    {
+      ptrdiff_t i = g.index(x0, y);
+      transportSpan(g, c, y, x0, x1, g.u.full + i, g.v.full + i, g.s.full + i);
+      continue;
     }
 
-    //Step 5: Erode and Deposit
-    for(int x = 0; x < size; x++)
+    for(int x = x0; x < x1; x += STATE_CHUNK)
     {
-      for(int y = 0; y < size; y++)
-      {
-        //find tilt angle
-
-        //horizontal side
-        float hHeightDelta = 0.0;
-        int index = 0;
-    		bool l;
-    		Crd lSide = getCoordAtDir(Crd(x, y), LEFT, size, l);
-        if(!l)
-        {
-          hHeightDelta += sim[x][y].b - sim[lSide.x][lSide.y].b;
-          ++index;
-        }
-
-    		bool r;
-    		Crd rSide = getCoordAtDir(Crd(x, y), RIGHT, size, r);
-        if(!r)
-        {
-          hHeightDelta += sim[rSide.x][rSide.y].b - sim[x][y].b;
-          ++index;
-        }
-
-        //adjust for boundary condition
-        if(index != 2)
-          hHeightDelta *= 2;
-
-        //vertical side
-        float vHeightDelta = 0.0;
-        index = 0;
-    		bool b;
-    		Crd bSide = getCoordAtDir(Crd(x, y), BOTTOM, size, b);
-        if(!b)
-        {
-          vHeightDelta += sim[x][y].b - sim[bSide.x][bSide.y].b;
-          ++index;
-        }
-
-    		bool t;
-    		Crd tSide = getCoordAtDir(Crd(x, y), TOP, size, t);
-        if(!t)
-        {
-          vHeightDelta += sim[tSide.x][tSide.y].b - sim[x][y].b;
-          ++index;
-        }
-
-        //adjust for boundary condition
-        if(index != 2)
-          vHeightDelta *= 2;
-
-        //find normal (and normalize)
-        float normal[3] = {hHeightDelta, PIPE_LENGTH, vHeightDelta};
-        float magnitude = sqrt(pow(normal[0], 2) + pow(normal[1], 2) + pow(normal[2], 2));
-        normal[0] /= magnitude;
-        normal[1] /= magnitude;
-        normal[2] /= magnitude;
-
-        float sinOfAngle = std::max(TILT_MIN, float(sqrt(1.0 - pow(normal[1], 2))));
-
-        float velMagnitude = sqrt(pow(sim[x][y].u, 2) + pow(sim[x][y].v, 2));
-
-        float transCapacity = SEDIMENT_CAP * sinOfAngle * velMagnitude;
-
-        if(transCapacity > sim[x][y].s)
-        {
-          //erode
-			    float sedChange = DISSOLVE_COEFF * (transCapacity - sim[x][y].s);
-
-          sim[x][y].b1 = std::max(0.0f, sim[x][y].b - sedChange);
-          sim[x][y].s1 = sim[x][y].s + sedChange;
-        }
-        else
-        {
-          //deposit
-          float sedChange = DEP_COEFF * (sim[x][y].s - transCapacity);
+      float u[STATE_CHUNK], v[STATE_CHUNK], s[STATE_CHUNK];
+      int count = std::min(STATE_CHUNK, x1 - x);
+      ptrdiff_t i = g.index(x, y);
+      readHalfState(g.u, i, count, u);
+      readHalfState(g.v, i, count, v);
+      readHalfState(g.s, i, count, s);
+      transportSpan(g, c, y, x, x + count, u, v, s);
+      writeHalfState(g.s, i, count, s);
+    }
+  }
+}
 
-          sim[x][y].b1 = sim[x][y].b + sedChange;
-          sim[x][y].s1 = std::max(0.0f, sim[x][y].s - sedChange);
-        }
+//Step 7: Evaporate Water
+//reads and writes d
+void stepEvaporate(ErosionGrid& g, const ErosionConstants& c, int x0, int x1, int y0, int y1)
+{
+  for(int y = y0; y < y1; y++)
+  {
+    float* d = g.d + g.index(0, y);
 
-        checkStability(sim[x][y]);
-      }
+    for(int x = x0; x < x1; x++)
+    {
+      d[x] *= c.evaporation;
+    }
+  }
+}
+
+//marks the slopes the terrain written by Step 5 has put out of date: those of every cell whose b, or b of
+//one of its neighbours, changed
+//runs between Step 5 and Step 8, while b1 and b hold the new and the old terrain, and each cell only marks itself,
+//so bands and tiles never write to each other's cells
+void markDirtySlopes(ErosionGrid& g, int x0, int x1, int y0, int y1)
+{
+  ptrdiff_t stride = g.stride;
+
+  for(int y = y0; y < y1; y++)
+  {
+    const float* b = g.b + g.index(0, y);
+    const float* b1 = g.b1 + g.index(0, y);
+    uint8_t* dirty = g.slopeDirty + g.index(0, y);
+
+    for(int x = x0; x < x1; x++)
+    {
+      bool moved = (b1[x] != b[x]) | (b1[x - 1] != b[x - 1]) | (b1[x + 1] != b[x + 1]) |
+                   (b1[x - stride] != b[x - stride]) | (b1[x + stride] != b[x + stride]);
+      dirty[x] |= uint8_t(moved);
     }
+  }
+}
+
+//Step 8: Move all changes back to center
+//dense runs swap the planes instead (ErosionGrid::swapBuffers()), sparse runs copy the tiles they simulated
+//reads b1, d2, writes b, d
+//only cells inside the grid are copied, the ghost border of b keeps its wall
+void stepCommit(ErosionGrid& g, int x0, int x1, int y0, int y1)
+{
+  for(int y = y0; y < y1; y++)
+  {
+    ptrdiff_t first = g.index(x0, y);
+    ptrdiff_t last = g.index(x1, y);
+
+    std::copy(g.b1 + first, g.b1 + last, g.b + first);
+    std::copy(g.d2 + first, g.d2 + last, g.d + first);
+  }
+}
+
+//splits rows into contiguous bands for the thread pool
+struct BandSplit
+{
+  BandSplit(int size, int bandCount) : start(bandCount + 1)
+  {
+    for(int j = 0; j <= bandCount; j++)
+      start[j] = int((long long)size * j / bandCount);
+  }
+
+  int count() const { return int(start.size()) - 1; }
+
+  std::vector<int> start;
+};
+
+//one iteration as eight separate steps
+//each parallelFor ends in a barrier, placed wherever a step reads neighbouring cells written by the previous one
+//returns false as soon as validation finds a bad cell
+bool runIteration(ErosionGrid& sim, ThreadPool& pool, const BandSplit& bands, const ErosionConstants& c, uint64_t seed, int iteration, StabilityCheck& check)
+{
+  //rainfall only touches its own cell, so it shares no barrier with anything before it
+  pool.parallelFor(bands.count(), [&](int j)
+  {
+    stepRainfall(sim, c, bands.start[j], bands.start[j + 1], seed, iteration);
+  });
+
+  //flux reads d1 of neighbouring rows
+  pool.parallelFor(bands.count(), [&](int j)
+  {
+    stepFlux(sim, c, 0, sim.size, bands.start[j], bands.start[j + 1]);
+    check.cells(sim, j, 0, sim.size, bands.start[j], bands.start[j + 1], STEP_FLUX);
+  });
+  if(check.failed)
+    return false;
+
+  //applying flux reads f of neighbouring rows, so it waits for every band to finish Step 2
+  //velocity only needs this cell's d2 (and f, final since Step 2) and erosion only this cell's u and v,
+  //so Steps 3 to 5 run back to back without barriers in between
+  pool.parallelFor(bands.count(), [&](int j)
+  {
+    stepApplyFlux(sim, c, 0, sim.size, bands.start[j], bands.start[j + 1]);
+    stepVelocity(sim, c, 0, sim.size, bands.start[j], bands.start[j + 1]);
+    check.cells(sim, j, 0, sim.size, bands.start[j], bands.start[j + 1], STEP_VELOCITY);
+    stepErodeDeposit(sim, c, 0, sim.size, bands.start[j], bands.start[j + 1]);
+  });
+  if(check.failed)
+    return false;
+
+  //transport reads s1 of neighbouring rows
+  pool.parallelFor(bands.count(), [&](int j)
+  {
+    stepTransport(sim, c, 0, sim.size, bands.start[j], bands.start[j + 1]);
+    stepEvaporate(sim, c, 0, sim.size, bands.start[j], bands.start[j + 1]);
+    markDirtySlopes(sim, 0, sim.size, bands.start[j], bands.start[j + 1]);
+  });
+
+  //Step 8 once every band is done with b and d
+  sim.swapBuffers();
+  return true;
+}
+
+const char* erosionStepName(int step)
+{
+  static const char* names[STEP_COUNT] =
+  {
+    "rainfall", "flux", "apply flux", "velocity", "erode/deposit", "transport", "evaporate", "commit"
+  };
+  return step >= 0 && step < STEP_COUNT ? names[step] : "unknown";
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+#ifdef EROSION_TRACE
+
+//water deeper than this makes a cell wet
+const float WET_DEPTH = 1e-6;
+
+//sums up the trace counters, between Step 7 and Step 8 while b1 and d2 still hold the new terrain and water
+//bands are reduced on their own and added up in order, so the totals do not depend on the thread count
+ErosionCounters measureCounters(ErosionGrid& sim, ThreadPool& pool, const BandSplit& bands)
+{
+  std::vector<ErosionCounters> partial(bands.count());
 
-    //Step 6: Transport Sediment
-    for(int x = 0; x < size; x++)
+  pool.parallelFor(bands.count(), [&](int j)
+  {
+    ErosionCounters& c = partial[j];
+
+    for(int y = bands.start[j]; y < bands.start[j + 1]; y++)
     {
-      for(int y = 0; y < size; y++)
+      for(int x = 0; x < sim.size; x++)
       {
-        float xSed = x - (sim[x][y].u * TIME_STEP);
-        float ySed = y - (sim[x][y].v * TIME_STEP);
-        int xDown = floor(xSed);
-        int yDown = floor(ySed);
-
-        if(xDown >= size - 1 || xDown < 0 || yDown >= size - 1 || yDown < 0)
-        {
-          //do not move sediment
-        }
+        ptrdiff_t i = sim.index(x, y);
+        float change = sim.b1[i] - sim.b[i];
+
+        c.water += sim.d2[i];
+        c.sediment += sim.s.get(i);
+        if(change < 0)
+          c.eroded -= change;
         else
-        {
-          sim[x][y].s = getInterpValue(sim[xDown][yDown].s1, sim[xDown + 1][yDown].s1, sim[xDown][yDown + 1].s1, sim[xDown + 1][yDown + 1].s1, xSed - xDown, ySed - yDown);
-        }
+          c.deposited += change;
+        if(sim.d2[i] > WET_DEPTH)
+          c.wetCells++;
+        for(int k = 0; k < 4; k++)
+          c.maxFlux = std::max(c.maxFlux, sim.f[k].get(i));
       }
     }
+  });
+
+  ErosionCounters total;
+  for(int j = 0; j < bands.count(); j++)
+  {
+    total.water += partial[j].water;
+    total.sediment += partial[j].sediment;
+    total.eroded += partial[j].eroded;
+    total.deposited += partial[j].deposited;
+    total.wetCells += partial[j].wetCells;
+    total.maxFlux = std::max(total.maxFlux, partial[j].maxFlux);
+  }
+  return total;
+}
 
-    //Step 7: Evaporate Water
-    for(int x = 0; x < size; x++)
+#endif
+
+//runIteration() with a barrier after every step, so each can be timed on its own
+//the extra barriers only add waiting, the result is the same
+bool runIterationTimed(ErosionGrid& sim, ThreadPool& pool, const BandSplit& bands, const ErosionConstants& c, uint64_t seed, int iteration, StabilityCheck& check, ErosionProfile* profile, ErosionTrace* trace)
+{
+  typedef void (*Step)(ErosionGrid&, const ErosionConstants&, int, int, int, int);
+  static const Step steps[STEP_COUNT] =
+  {
+    NULL, stepFlux, stepApplyFlux, stepVelocity, stepErodeDeposit, stepTransport, stepEvaporate, NULL
+  };
+
+  for(int step = STEP_RAINFALL; step < STEP_COUNT; step++)
+  {
+#ifdef EROSION_TRACE
+    if(trace != NULL && step == STEP_COMMIT)
+      trace->recordCounters(iteration, measureCounters(sim, pool, bands));
+#endif
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if(step == STEP_COMMIT)
+      sim.swapBuffers();
+    else
     {
-      for(int y = 0; y < size; y++)
+      pool.parallelFor(bands.count(), [&](int j)
       {
-        sim[x][y].d *= 1 - (EVAP_COEFF * TIME_STEP);
-      }
+        if(step == STEP_RAINFALL)
+          stepRainfall(sim, c, bands.start[j], bands.start[j + 1], seed, iteration);
+        else
+          steps[step](sim, c, 0, sim.size, bands.start[j], bands.start[j + 1]);
+
+        if(step == STEP_EVAPORATE)
+          markDirtySlopes(sim, 0, sim.size, bands.start[j], bands.start[j + 1]);
+
+        if(step == STEP_FLUX || step == STEP_VELOCITY)
+          check.cells(sim, j, 0, sim.size, bands.start[j], bands.start[j + 1], step);
+      });
+    }
+    double seconds = secondsSince(start);
+
+    if(profile != NULL)
+      profile->stepSeconds[step] += seconds;
+#ifdef EROSION_TRACE
+    if(trace != NULL)
+      trace->recordStep(iteration, step, start, seconds);
+#else
+    (void)trace;
+#endif
+
+    if(check.failed)
+      return false;
+  }
+  return true;
+}
+
+//one iteration as three sweeps
+//every step still runs on its own, but row by row, so a row is pushed through several steps while it is in cache
+//the per-cell arithmetic is untouched, which keeps the result bit-identical to runIteration()
+bool runIterationFused(ErosionGrid& sim, ThreadPool& pool, const BandSplit& bands, const ErosionConstants& c, uint64_t seed, int iteration, StabilityCheck& check)
+{
+  int size = sim.size;
+
+  //Sweep A: rainfall and flux
+  //rainfall stays one row ahead of flux, which needs d1 of the rows on either side
+  //the rows just outside a band are the first and last rows of its neighbours, so those are rained on first
+  pool.parallelFor(bands.count(), [&](int j)
+  {
+    int y0 = bands.start[j];
+    int y1 = bands.start[j + 1];
+
+    stepRainfall(sim, c, y0, y0 + 1, seed, iteration);
+    if(y1 - 1 > y0)
+      stepRainfall(sim, c, y1 - 1, y1, seed, iteration);
+  });
+
+  pool.parallelFor(bands.count(), [&](int j)
+  {
+    int y0 = bands.start[j];
+    int y1 = bands.start[j + 1];
+
+    for(int y = y0; y < y1; y++)
+    {
+      if(y + 1 < y1 - 1)
+        stepRainfall(sim, c, y + 1, y + 2, seed, iteration);
+
+      stepFlux(sim, c, 0, size, y, y + 1);
+      check.cells(sim, j, 0, size, y, y + 1, STEP_FLUX);
+    }
+  });
+  if(check.failed)
+    return false;
+
+  //Sweep B: apply flux, velocity, erode and deposit
+  pool.parallelFor(bands.count(), [&](int j)
+  {
+    for(int y = bands.start[j]; y < bands.start[j + 1]; y++)
+    {
+      stepApplyFlux(sim, c, 0, size, y, y + 1);
+      stepVelocity(sim, c, 0, size, y, y + 1);
+      check.cells(sim, j, 0, size, y, y + 1, STEP_VELOCITY);
+      stepErodeDeposit(sim, c, 0, size, y, y + 1);
+    }
+  });
+  if(check.failed)
+    return false;
+
+  //Sweep C: transport and evaporate, then move changes back to center
+  pool.parallelFor(bands.count(), [&](int j)
+  {
+    for(int y = bands.start[j]; y < bands.start[j + 1]; y++)
+    {
+      stepTransport(sim, c, 0, size, y, y + 1);
+      stepEvaporate(sim, c, 0, size, y, y + 1);
+      markDirtySlopes(sim, 0, size, y, y + 1);
+    }
+  });
+
+  sim.swapBuffers();
+  return true;
+}
+
+//whether any of cells [x0, x1) of row y of a plane is above limit (or NaN)
+template<class Ops, class T>
+bool anyAboveInSpan(const ErosionGrid& g, const T* plane, int y, int x0, int x1, float limit)
+{
+  typedef typename Ops::Mask Mask;
+  const typename Ops::V top = Ops::set(limit);
+  const T* row = plane + g.index(0, y);
+  Mask below = Ops::lessEqual(top, top);
+
+  for(int x = x0; x < x1; x += Ops::width)
+    below = Ops::both(below, Ops::lessEqual(Ops::load(row + x), top));
+  return !Ops::allTrue(below);
+}
+
+//the same over rows [y0, y1), stopping at the first row found
+template<class T>
+bool anyAbove(const ErosionGrid& g, const T* plane, int x0, int x1, int y0, int y1, float limit)
+{
+  int end = vectorEnd(x0, x1);
+  for(int y = y0; y < y1; y++)
+  {
+    if(anyAboveInSpan<VectorOps>(g, plane, y, x0, end, limit) || anyAboveInSpan<ScalarOps>(g, plane, y, end, x1, limit))
+      return true;
+  }
+  return false;
+}
+
+//half planes are compared as they are held, against the limit scaled by the same power of two
+bool anyAbove(const ErosionGrid& g, const StatePlane& plane, int x0, int x1, int y0, int y1, float limit)
+{
+  if(plane.half != NULL)
+    return anyAbove(g, plane.half, x0, x1, y0, y1, limit * plane.scale);
+  return anyAbove(g, plane.full, x0, x1, y0, y1, limit);
+}
+
+//copies cells [first, last) of a state plane to a float plane
+void copyState(const StatePlane& from, float* to, ptrdiff_t first, ptrdiff_t last)
+{
+  if(from.full != NULL)
+    std::copy(from.full + first, from.full + last, to + first);
+  else
+  {
+    for(ptrdiff_t i = first; i < last; i++)
+      to[i] = from.get(i);
+  }
+}
+
+//tiles of a sparse run, see ErosionSettings::sparseTileSize
+//a tile is wet while any of its cells holds water, sediment or flux above the thresholds, and each iteration
+//simulates the wet tiles and their neighbours: a cell with no water, sediment or flux whose four neighbours
+//have no water either gets no flux out, no inflow, no velocity and so nothing to erode, deposit or carry
+struct SparseTiles
+{
+  //a tile size of 0 leaves it empty, for dense runs
+  SparseTiles(const ErosionGrid& g, int size, const ErosionSettings& settings)
+    : depth(settings.sparseDepth), sediment(settings.sparseSediment), flux(settings.sparseFlux), activeCells(0)
+  {
+    //whole vectors per tile keep every cell on the same vector or scalar path as in a dense run
+    tileSize = (std::max(size, 1) + 7) / 8 * 8;
+    perSide = size > 0 ? (g.size + tileSize - 1) / tileSize : 0;
+    wet.resize(size_t(perSide) * perSide);
+    ran.assign(wet.size(), 1);
+    resumed.assign(wet.size(), 0);
+
+    for(int t = 0; t < count(); t++)
+      wet[t] = holdsAnything(g, t);
+  }
+
+  int count() const { return int(wet.size()); }
+
+  int x0(int t) const { return t % perSide * tileSize; }
+  int y0(int t) const { return t / perSide * tileSize; }
+  int x1(const ErosionGrid& g, int t) const { return std::min(g.size, x0(t) + tileSize); }
+  int y1(const ErosionGrid& g, int t) const { return std::min(g.size, y0(t) + tileSize); }
+
+  //read at the end of an iteration, when d is the new water
+  bool holdsAnything(const ErosionGrid& g, int t) const
+  {
+    int xa = x0(t), xb = x1(g, t), ya = y0(t), yb = y1(g, t);
+    bool any = anyAbove(g, g.d, xa, xb, ya, yb, depth) || anyAbove(g, g.s, xa, xb, ya, yb, sediment);
+    for(int k = 0; k < 4 && !any; k++)
+      any = anyAbove(g, g.f[k], xa, xb, ya, yb, flux);
+    return any;
+  }
+
+  //read after Step 1
+  bool rainedOn(const ErosionGrid& g, int t) const
+  {
+    return anyAbove(g, g.d, x0(t), x1(g, t), y0(t), y1(g, t), depth);
+  }
+
+  //lists the tiles to simulate this iteration
+  //side by side active tiles are merged into runs, which are swept a whole row at a time: a tile alone
+  //reads a short piece of each of many rows, which costs more in TLB misses and prefetches than it saves
+  void schedule(const ErosionGrid& g)
+  {
+    runs.clear();
+    activeCells = 0;
+
+    for(int t = 0; t < count(); t++)
+    {
+      int tx = t % perSide;
+      int ty = t / perSide;
+      unsigned char before = ran[t];
+      ran[t] = wet[t] || (tx > 0 && wet[t - 1]) || (tx + 1 < perSide && wet[t + 1]) ||
+               (ty > 0 && wet[t - perSide]) || (ty + 1 < perSide && wet[t + perSide]);
+      resumed[t] = ran[t] && !before;
+      if(!ran[t])
+        continue;
+
+      if(tx > 0 && ran[t - 1])
+        runs.back().last = t;
+      else
+        runs.push_back(TileRun(t));
+      activeCells += double(x1(g, t) - x0(t)) * (y1(g, t) - y0(t));
     }
+  }
+
+  int tileSize;
+  int perSide;
+
+  float depth;
+  float sediment;
+  float flux;
+
+  //per tile, indexed ty * perSide + tx
+  std::vector<unsigned char> wet;
+  std::vector<unsigned char> ran;
 
-    //Step 8: Move all changes back to center
-    for(int x = 0; x < size; x++)
+  //simulated this iteration after being skipped the last one, while neighbouring tiles may have changed the
+  //terrain its slopes were worked out from without marking them
+  std::vector<unsigned char> resumed;
+
+  //tiles first to last of one row of tiles
+  struct TileRun
+  {
+    TileRun(int t) : first(t), last(t) {}
+    int first;
+    int last;
+  };
+
+  //tiles simulated this iteration and how many cells they hold
+  std::vector<TileRun> runs;
+  double activeCells;
+};
+
+//one iteration over the tiles scheduled by tiles, with the same barriers as runIteration() and one more before Step 8
+//each run of active tiles is one task, so the list of runs is the work queue
+bool runIterationSparse(ErosionGrid& sim, ThreadPool& pool, SparseTiles& tiles, const ErosionConstants& c, uint64_t seed, int iteration, StabilityCheck& check)
+{
+  //rainfall runs everywhere, a row of tiles per task, and wakes up the dry tiles it lands on
+  //a dry tile simulated last iteration gets s1 = s back, which is what Step 5 would give it while skipped,
+  //as Step 6 of its neighbours still reads it
+  pool.parallelFor(tiles.perSide, [&](int ty)
+  {
+    int y0 = ty * tiles.tileSize;
+    stepRainfall(sim, c, y0, std::min(sim.size, y0 + tiles.tileSize), seed, iteration);
+
+    for(int t = ty * tiles.perSide; t < (ty + 1) * tiles.perSide; t++)
     {
-      for(int y = 0; y < size; y++)
+      if(tiles.wet[t])
+        continue;
+
+      if(tiles.ran[t])
       {
-        sim[x][y].b = sim[x][y].b1;
-        sim[x][y].d = sim[x][y].d2;
-        /*
-        if(x == 100 && y == 100)
-        {
-          std::cout << "WAT- " << sim[x][y].d << std::endl;
-          std::cout << "Left- " << sim[x][y].f[LEFT] << std::endl;
-          std::cout << "leftIn- " << sim[x - 1][y].f[RIGHT] << std::endl;
-          std::cout << "Right- " << sim[x][y].f[1] << std::endl;
-          std::cout << "Top- " << sim[x][y].f[2] << std::endl;
-          std::cout << "Bot- " << sim[x][y].f[3] << std::endl;
-        }
-        */
+        for(int y = tiles.y0(t); y < tiles.y1(sim, t); y++)
+          copyState(sim.s, sim.s1, sim.index(tiles.x0(t), y), sim.index(tiles.x1(sim, t), y));
       }
+      tiles.wet[t] = tiles.rainedOn(sim, t);
     }
-  }
+  });
 
-  //convert water
-  water = new float[size * size];
-  for(int x = 0; x < size; x++)
+  tiles.schedule(sim);
+  const std::vector<SparseTiles::TileRun>& runs = tiles.runs;
+
+  //validation keeps one slot per tile, each run uses the slot of its first tile
+  pool.parallelFor(int(runs.size()), [&](int k)
+  {
+    int t = runs[k].first;
+    int x0 = tiles.x0(t), x1 = tiles.x1(sim, runs[k].last), y0 = tiles.y0(t), y1 = tiles.y1(sim, t);
+    stepFlux(sim, c, x0, x1, y0, y1);
+    check.cells(sim, t, x0, x1, y0, y1, STEP_FLUX);
+  });
+  if(check.failed)
+    return false;
+
+  pool.parallelFor(int(runs.size()), [&](int k)
   {
-    for(int y = 0; y < size; y++)
+    int t = runs[k].first;
+    int x0 = tiles.x0(t), x1 = tiles.x1(sim, runs[k].last), y0 = tiles.y0(t), y1 = tiles.y1(sim, t);
+    for(int r = t; r <= runs[k].last; r++)
     {
-      water[coord(x, y, size)] = sim[x][y].d;
+      if(tiles.resumed[r])
+        sim.invalidateSlopes(tiles.x0(r), tiles.x1(sim, r), y0, y1);
     }
+
+    stepApplyFlux(sim, c, x0, x1, y0, y1);
+    stepVelocity(sim, c, x0, x1, y0, y1);
+    check.cells(sim, t, x0, x1, y0, y1, STEP_VELOCITY);
+    stepErodeDeposit(sim, c, x0, x1, y0, y1);
+  });
+  if(check.failed)
+    return false;
+
+  pool.parallelFor(int(runs.size()), [&](int k)
+  {
+    int t = runs[k].first;
+    int x0 = tiles.x0(t), x1 = tiles.x1(sim, runs[k].last), y0 = tiles.y0(t), y1 = tiles.y1(sim, t);
+    stepTransport(sim, c, x0, x1, y0, y1);
+    stepEvaporate(sim, c, x0, x1, y0, y1);
+    markDirtySlopes(sim, x0, x1, y0, y1);
+  });
+
+  //slopes are marked from b and b1 of neighbouring tiles, so no tile commits before every tile is marked
+  pool.parallelFor(int(runs.size()), [&](int k)
+  {
+    int t = runs[k].first;
+    int x0 = tiles.x0(t), x1 = tiles.x1(sim, runs[k].last), y0 = tiles.y0(t), y1 = tiles.y1(sim, t);
+    stepCommit(sim, x0, x1, y0, y1);
+    for(; t <= runs[k].last; t++)
+      tiles.wet[t] = tiles.holdsAnything(sim, t);
+  });
+  return true;
+}
+
+//runs iterations [firstIteration, firstIteration + iterations) on a grid whose terrain has been loaded and walled in
+//stops at the first iteration failing validation, reporting it through settings.error or on std::cout
+bool simulate(ErosionGrid& sim, uint64_t seed, const ErosionSettings& settings, int firstIteration, int iterations)
+{
+  int size = sim.size;
+
+  //split the rows into bands, a few per thread so uneven bands balance out
+  //every cell is computed the same way whichever band it lands in, so the result does not depend on the thread count
+  ThreadPool pool(settings.threads);
+  BandSplit bands(size, std::min(size, pool.threadCount() * BANDS_PER_THREAD));
+  ErosionConstants constants(settings.params, size);
+
+#ifdef EROSION_TRACE
+  bool tracing = settings.trace != NULL;
+#else
+  bool tracing = false;
+#endif
+
+  bool sparse = settings.sparseTileSize > 0 && !tracing;
+  SparseTiles tiles(sim, sparse ? settings.sparseTileSize : 0, settings);
+
+  StabilityCheck check(sparse ? tiles.count() : bands.count());
+  int interval = std::max(1, settings.validationInterval);
+
+  bool checkpointing = settings.checkpointInterval > 0 && !settings.checkpointPath.empty();
+
+  //the terrain has been loaded since the grid was made
+  sim.invalidateSlopes(0, size, 0, size);
+  CheckpointWriter checkpoints(settings.checkpointPath);
+
+  //main loop
+  for(int i = firstIteration; i < firstIteration + iterations; i++)
+  {
+    //std::cout << "Iteration " << i << std::endl;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    check.enabled = settings.validation == VALIDATE_ALWAYS || (settings.validation == VALIDATE_INTERVAL && i % interval == 0);
+
+    bool stable;
+    if(sparse)
+      stable = runIterationSparse(sim, pool, tiles, constants, seed, i, check);
+    else if(tracing || (settings.profile != NULL && !settings.fused))
+      stable = runIterationTimed(sim, pool, bands, constants, seed, i, check, settings.profile, settings.trace);
+    else if(settings.fused)
+      stable = runIterationFused(sim, pool, bands, constants, seed, i, check);
+    else
+      stable = runIteration(sim, pool, bands, constants, seed, i, check);
+
+    if(!stable)
+    {
+      ErosionError error;
+      check.report(sim, i, error);
+      if(settings.error != NULL)
+        *settings.error = error;
+      else
+        error.print();
+      return false;
+    }
+
+    if(settings.profile != NULL)
+    {
+      double seconds = secondsSince(start);
+      settings.profile->iterations++;
+      settings.profile->totalSeconds += seconds;
+      settings.profile->slowestIteration = std::max(settings.profile->slowestIteration, seconds);
+      settings.profile->cellUpdates += sparse ? tiles.activeCells : double(size) * size;
+    }
+
+    if(checkpointing && (i + 1) % settings.checkpointInterval == 0)
+      checkpoints.save(sim, seed, i + 1);
   }
 
+  if(checkpointing && !checkpoints.finish())
+    std::cout << "Could not write checkpoint " << settings.checkpointPath << std::endl;
+  return true;
+}
+
+//copies the terrain and water out of a finished grid
+float* storeResult(const ErosionGrid& sim, float*& water)
+{
+  size_t cells = size_t(sim.size) * sim.size;
+
+  //convert water
+  water = new float[cells];
+  sim.store(sim.d, water);
+
   //Convert back to float array
-  float* eroded = new float[size * size];
-  for(int x = 0; x < size; x++)
+  float* eroded = new float[cells];
+  sim.store(sim.b, eroded);
+
+  return eroded;
+}
+
+void ErosionError::print() const
+{
+  std::cout << "Listing Diagnostic:" << std::endl;
+  std::cout << "cell " << x << ", " << y << " iteration " << iteration << " after " << erosionStepName(step) << std::endl;
+  std::cout << "b " << b << std::endl;
+  std::cout << "d1 " << d1 << std::endl;
+  std::cout << "d2 " << d2 << std::endl;
+  std::cout << "s " << s << std::endl;
+  std::cout << "f " << f[LEFT] << " " << f[RIGHT] << " " << f[TOP] << " " << f[BOTTOM] << std::endl;
+  std::cout << "u " << u << std::endl;
+  std::cout << "v " << v << std::endl;
+}
+
+//coarse-to-fine erosion, see ErosionSettings::levelIterations
+//iterations are numbered on across levels, so every level draws its own rainfall
+float* erodeFieldMultigrid(float* field, float*& water, int size, uint64_t seed, const ErosionSettings& settings)
+{
+  int levels = int(settings.levelIterations.size());
+
+  //input terrain at every level, finest first
+  std::vector<int> sizes(1, size);
+  std::vector<std::vector<float> > terrain(1, std::vector<float>(field, field + size_t(size) * size));
+  while(int(sizes.size()) < levels && sizes.back() > 3)
+  {
+    int reduced = (sizes.back() - 1) / 2 + 1;
+    terrain.push_back(std::vector<float>(size_t(reduced) * reduced));
+    downsampleField(&terrain[terrain.size() - 2][0], sizes.back(), &terrain.back()[0], reduced);
+    sizes.push_back(reduced);
+  }
+
+  //levels the grid is too small to halve for just run at the coarsest size there is
+  //state carried down from the level above: terrain change, water and sediment
+  std::vector<float> change;
+  std::vector<float> depth;
+  std::vector<float> sediment;
+  int changeSize = 0;
+  int iteration = 0;
+
+  ErosionSettings levelSettings(settings);
+  levelSettings.checkpointInterval = 0;
+
+  for(int level = levels - 1; level >= 0; level--)
   {
-    for(int y = 0; y < size; y++)
+    int k = std::min(level, int(sizes.size()) - 1);
+    int levelSize = sizes[k];
+    size_t cells = size_t(levelSize) * levelSize;
+    ErosionGrid sim(levelSize, settings.halfPrecision);
+
+    std::vector<float> start(terrain[k]);
+    if(changeSize != 0)
+    {
+      //rainfall drops the same number of raindrops per iteration at any size, so a coarse cell holds
+      //the water of several fine ones; depths are spread over the finer cells to keep the total volume,
+      //and clamped where they overshoot below zero between samples
+      float area = float(changeSize - 1) * (changeSize - 1) / (float(levelSize - 1) * (levelSize - 1));
+      std::vector<float> up(cells);
+      bicubicInterpolate(&change[0], changeSize, &up[0], levelSize, settings.threads);
+      for(size_t i = 0; i < cells; i++)
+        start[i] += up[i];
+
+      bicubicInterpolate(&depth[0], changeSize, &up[0], levelSize, settings.threads);
+      for(size_t i = 0; i < cells; i++)
+        up[i] = std::max(0.0f, up[i]) * area;
+      sim.load(sim.d, &up[0]);
+
+      bicubicInterpolate(&sediment[0], changeSize, &up[0], levelSize, settings.threads);
+      for(size_t i = 0; i < cells; i++)
+        up[i] = std::max(0.0f, up[i]) * area;
+      sim.load(sim.s, &up[0]);
+    }
+
+    sim.load(sim.b, &start[0]);
+
+    int levelIterations = settings.levelIterations[levels - 1 - level];
+    if(!simulate(sim, seed, levelSettings, iteration, levelIterations))
     {
-      eroded[coord(x, y, size)] = sim[x][y].b;
+      water = NULL;
+      return NULL;
     }
+    iteration += levelIterations;
+
+    if(level == 0)
+      return storeResult(sim, water);
+
+    change.resize(cells);
+    depth.resize(cells);
+    sediment.resize(cells);
+    sim.store(sim.b, &change[0]);
+    sim.store(sim.d, &depth[0]);
+    sim.store(sim.s, &sediment[0]);
+    for(size_t i = 0; i < cells; i++)
+      change[i] -= terrain[k][i];
+    changeSize = levelSize;
   }
 
-  return eroded;
+  return NULL;
+}
+
+float* erodeField(float* field, float*& water, int size, uint64_t seed, const ErosionSettings& settings)
+{
+  if(!settings.levelIterations.empty())
+    return erodeFieldMultigrid(field, water, size, seed, settings);
+
+  //create structure-of-arrays grid, walled in with every plane inside at zero
+  ErosionGrid sim(size, settings.halfPrecision);
+
+  //Set terrain height to values stored in field
+  sim.load(sim.b, field);
+
+  if(!simulate(sim, seed, settings, 0, settings.iterations))
+  {
+    water = NULL;
+    return NULL;
+  }
+
+  return storeResult(sim, water);
+}
+
+float* resumeErosion(const std::string& checkpoint, float*& water, int& size, const ErosionSettings& settings)
+{
+  water = NULL;
+
+  CheckpointInfo info;
+  if(!readCheckpointInfo(checkpoint, info))
+    return NULL;
+
+  ErosionGrid sim(info.size, settings.halfPrecision);
+  if(!loadCheckpoint(checkpoint, sim))
+    return NULL;
+
+  if(!simulate(sim, info.seed, settings, info.iteration, std::max(0, settings.iterations - info.iteration)))
+    return NULL;
+
+  size = info.size;
+  return storeResult(sim, water);
+}
+
+bool erodeHeightfield(Heightfield& field, uint64_t seed, const ErosionSettings& settings)
+{
+  int size = field.size();
+  if(field.channelCount() <= CHANNEL_WATER)
+    return false;
+
+  //tiles are copied straight into and out of the grid planes
+  ErosionGrid sim(size, settings.halfPrecision);
+  field.readRegion(CHANNEL_HEIGHT, 0, 0, 0, size, size, sim.b, sim.stride);
+
+  if(!simulate(sim, seed, settings, 0, settings.iterations))
+    return false;
+
+  field.writeRegion(CHANNEL_HEIGHT, 0, 0, 0, size, size, sim.b, sim.stride);
+  field.writeRegion(CHANNEL_WATER, 0, 0, 0, size, size, sim.d, sim.stride);
+  if(field.channelCount() > CHANNEL_SEDIMENT && sim.s.full != NULL)
+    field.writeRegion(CHANNEL_SEDIMENT, 0, 0, 0, size, size, sim.s.full, sim.stride);
+  else if(field.channelCount() > CHANNEL_SEDIMENT)
+  {
+    //half sediment goes out through a float copy
+    std::vector<float> sediment(size_t(size) * size);
+    sim.store(sim.s, &sediment[0]);
+    field.writeRegion(CHANNEL_SEDIMENT, 0, 0, 0, size, size, &sediment[0], size);
+  }
+
+  for(int channel = 0; channel < std::min(field.channelCount(), 3); channel++)
+    field.buildMips(channel, settings.threads);
+
+  return true;
 }
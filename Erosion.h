@@ -1,3 +1,208 @@
 #pragma once
 
-float* erodeField(float* field, float*& water, int size);
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+//time spent in each step of the simulation, summed over every iteration
+enum ErosionStep
+{
+  STEP_RAINFALL,
+  STEP_FLUX,
+  STEP_APPLY_FLUX,
+  STEP_VELOCITY,
+  STEP_ERODE_DEPOSIT,
+  STEP_TRANSPORT,
+  STEP_EVAPORATE,
+  STEP_COMMIT,
+  STEP_COUNT
+};
+
+struct ErosionProfile
+{
+  ErosionProfile() : iterations(0), totalSeconds(0), slowestIteration(0), cellUpdates(0)
+  {
+    for(int i = 0; i < STEP_COUNT; i++)
+      stepSeconds[i] = 0;
+  }
+
+  int iterations;
+  double totalSeconds;
+  double slowestIteration;
+
+  //cells simulated, summed over every iteration: size * size per iteration unless sparse tiles were skipped
+  double cellUpdates;
+
+  //left at zero by fused runs, whose steps are interleaved, and by sparse runs
+  double stepSeconds[STEP_COUNT];
+};
+
+const char* erosionStepName(int step);
+
+class ErosionTrace;
+
+//first cell found out of range by validation, with its state when it was found
+struct ErosionError
+{
+  ErosionError() : x(-1), y(-1), iteration(-1), step(0), b(0), d1(0), d2(0), s(0), u(0), v(0)
+  {
+    for(int k = 0; k < 4; k++)
+      f[k] = 0;
+  }
+
+  //prints the cell, where it was found and its values on std::cout
+  void print() const;
+
+  int x;
+  int y;
+  int iteration;
+  int step;
+
+  float b;
+
+  //water after rainfall and after Step 3, which is only up to date when the cell fails after velocity
+  float d1;
+  float d2;
+  float s;
+  float f[4];
+  float u;
+  float v;
+};
+
+enum ErosionValidation
+{
+  VALIDATE_OFF,
+  VALIDATE_INTERVAL,
+  VALIDATE_ALWAYS
+};
+
+//physical constants of the simulation, which shape the terrain it carves
+//the defaults are the constants erodeField() has always used; any set of them is bit-identical across
+//thread counts and modes, and resuming from a checkpoint needs the ones it was written with
+struct ErosionParams
+{
+  ErosionParams()
+    : timeStep(0.0002), raindropSize(0.1), rainProbability(0.05), pipeCrossSection(0.05), gravity(0.05),
+      pipeLength(0.001), tiltMin(0), sedimentCapacity(0.07), dissolveRate(0.0002), depositRate(0.0008),
+      evaporationRate(0.001) {}
+
+  //simulated time per iteration, which scales the flux, sediment transport and evaporation of each step; rain,
+  //erosion and deposition stay per iteration
+  //the model is not converged in the step, so a bigger step with fewer iterations is a quality trade-off rather than
+  //the same erosion sooner: over 0.2 of simulated time on a 257 grid, steps of 1e-4, 3e-4 and 4e-4 carve 2.2, 0.54
+  //and 0.27 times the terrain change of the default, and leave water in proportion to the iterations run
+  //past sqrt(l^3 / (2 A g)) for pipe length l, cross-section A and gravity g (4.5e-4 with the defaults) the flux
+  //update is unstable, and only the outflow limit of Step 2 keeps water from swinging between neighbours
+  float timeStep;
+
+  //water added by one raindrop; each cell is rained on with odds of 1 in size * size * rainProbability,
+  //so about 1 / rainProbability drops land per iteration whatever the size of the grid
+  float raindropSize;
+  float rainProbability;
+
+  //virtual pipes between neighbouring cells, which carry the flux
+  float pipeCrossSection;
+  float gravity;
+  float pipeLength;
+
+  //lower bound on the sine of the slope, so flat ground still erodes
+  float tiltMin;
+
+  //sediment a unit of flow can carry on a unit slope, and the rates sediment is picked up and dropped at
+  float sedimentCapacity;
+  float dissolveRate;
+  float depositRate;
+
+  float evaporationRate;
+};
+
+struct ErosionSettings
+{
+  ErosionSettings()
+    : threads(1), fused(false), halfPrecision(false), iterations(1000), profile(NULL), trace(NULL),
+      validation(VALIDATE_ALWAYS), validationInterval(100), error(NULL),
+      sparseTileSize(0), sparseDepth(0), sparseSediment(0), sparseFlux(0), checkpointInterval(0) {}
+
+  //threads used for the simulation, 0 uses every hardware thread
+  //results are bit-identical for any thread count
+  int threads;
+
+  //run each iteration as three sweeps over the grid instead of eight
+  //(rainfall + flux, apply + velocity + erosion, transport + evaporation + commit)
+  //equivalence tolerance against the unfused path is zero: the fused path only reorders whole rows
+  //of the same per-cell arithmetic, so both produce the same bits when built with the same compiler flags
+  bool fused;
+
+  //hold sediment, flux and velocity as half floats (terrain and water stay float, and all arithmetic is float),
+  //which takes the state from 53 to 39 bytes per cell
+  //error budget, measured against float on a 1025 grid after 300 iterations: terrain is off by 1.1% of the mean
+  //terrain change on average (1% of cells by more than 4% of the largest change) and total water by 0.004%;
+  //for scale, float builds with and without FMA differ by 0.2% on average
+  //results stay bit-identical for any thread count and between plain, fused and sparse runs
+  //conversions use F16C when the compiler targets it (-mf16c, -march=native); without it they are done
+  //in software, which costs more time than the smaller planes save
+  bool halfPrecision;
+
+  //iterations of the simulation loop
+  int iterations;
+
+  //when set, every iteration is timed into it, and plain (not fused or sparse) runs put a barrier after every step to time
+  //the steps one by one (same result, a little slower)
+  ErosionProfile* profile;
+
+  //per-iteration step times and counters, only recorded in builds with EROSION_TRACE defined (see ErosionTrace.h)
+  ErosionTrace* trace;
+
+  //range checks on the simulation state (finite values, no negative water, terrain above -1, flux up to 10000),
+  //run after Steps 2 and 4 on every iteration, on every validationInterval-th iteration or not at all
+  ErosionValidation validation;
+  int validationInterval;
+
+  //receives the first bad cell when validation fails, which is otherwise printed
+  ErosionError* error;
+
+  //sparse scheduling: the grid is split into square tiles this many cells across (rounded up to a multiple
+  //of 8), and each iteration only simulates tiles holding water, sediment or flux above the thresholds below,
+  //plus their four neighbours, which water can reach in one iteration; 0 simulates every cell
+  //rainfall still runs over every cell, so rain wakes a dry tile up the iteration it lands
+  //with the thresholds at 0 every tile skipped is one the simulation would have left exactly as it was, so the
+  //result is bit-identical to a dense run; above 0, tiles left with no more than a trace stop being simulated
+  //takes over from fused and from per-step profiling, but not from tracing, which always runs every cell
+  int sparseTileSize;
+  float sparseDepth;
+  float sparseSediment;
+  float sparseFlux;
+
+  //every checkpointInterval iterations the simulation state is written to checkpointPath on a background
+  //thread (see ErosionCheckpoint.h), for resumeErosion() to carry on from; 0 writes none
+  //the state is copied first, which takes a buffer of 7 floats per cell while a run is checkpointing
+  //coarse-to-fine runs write no checkpoints
+  std::string checkpointPath;
+  int checkpointInterval;
+
+  ErosionParams params;
+
+  //coarse-to-fine mode: iterations run at each level, coarsest first, the last entry at full resolution
+  //every level above it has half the cells across (a quarter of the cells) of the one below, and starts
+  //from the terrain change, water and sediment of the level above, interpolated up
+  //empty runs `iterations` at full resolution only; erodeHeightfield() always runs at full resolution
+  std::vector<int> levelIterations;
+};
+
+//rainfall is drawn from seed, so the same seed and input always erode the same way
+//returns NULL (and water NULL) if validation fails
+float* erodeField(float* field, float*& water, int size, uint64_t seed, const ErosionSettings& settings = ErosionSettings());
+
+//carries on a run from a checkpoint up to settings.iterations in total, with the seed and size it was saved with
+//given the settings the checkpoint was written with, the result is bit-identical to the run never stopping
+//settings.levelIterations is ignored; returns NULL (and water NULL) if the checkpoint cannot be read or validation fails
+float* resumeErosion(const std::string& checkpoint, float*& water, int& size, const ErosionSettings& settings = ErosionSettings());
+
+class Heightfield;
+
+//erodes level 0 of a heightfield's height channel in place, writing the water (and sediment, if the file
+//has that channel) left at the end, then rebuilds the mip levels of all three
+//the whole level is simulated in memory, so it must fit there
+//returns false, leaving the file untouched, if validation fails
+bool erodeHeightfield(Heightfield& field, uint64_t seed, const ErosionSettings& settings = ErosionSettings());
@@ -0,0 +1,147 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "ErosionCheckpoint.h"
+#include "ErosionGrid.h"
+
+const char CHECKPOINT_MAGIC[8] = {'E', 'R', 'O', 'D', 'E', 'C', 'K', 'P'};
+const uint32_t CHECKPOINT_VERSION = 1;
+
+//b, d, s and f[0..3]
+const int CHECKPOINT_PLANES = 7;
+
+struct CheckpointHeader
+{
+  char magic[8];
+  uint32_t version;
+  int32_t size;
+  uint64_t seed;
+  int32_t iteration;
+  int32_t planes;
+};
+
+//copy plane p, in file order, between a grid and a dense array
+//half planes go through floats, which gives back the same halves when loaded
+void storeCheckpointPlane(const ErosionGrid& sim, int p, float* dense)
+{
+  if(p == 0)
+    sim.store(sim.b, dense);
+  else if(p == 1)
+    sim.store(sim.d, dense);
+  else if(p == 2)
+    sim.store(sim.s, dense);
+  else
+    sim.store(sim.f[p - 3], dense);
+}
+
+void loadCheckpointPlane(ErosionGrid& sim, int p, const float* dense)
+{
+  if(p == 0)
+    sim.load(sim.b, dense);
+  else if(p == 1)
+    sim.load(sim.d, dense);
+  else if(p == 2)
+    sim.load(sim.s, dense);
+  else
+    sim.load(sim.f[p - 3], dense);
+}
+
+CheckpointWriter::CheckpointWriter(const std::string& path) : path(path), failed(false)
+{
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+  finish();
+}
+
+void CheckpointWriter::save(const ErosionGrid& sim, uint64_t seed, int iteration)
+{
+  finish();
+
+  size_t cells = size_t(sim.size) * sim.size;
+  planes.resize(cells * CHECKPOINT_PLANES);
+
+  for(int p = 0; p < CHECKPOINT_PLANES; p++)
+    storeCheckpointPlane(sim, p, &planes[cells * p]);
+
+  info.size = sim.size;
+  info.seed = seed;
+  info.iteration = iteration;
+  worker = std::thread(&CheckpointWriter::write, this);
+}
+
+bool CheckpointWriter::finish()
+{
+  if(worker.joinable())
+    worker.join();
+  return !failed;
+}
+
+void CheckpointWriter::write()
+{
+  CheckpointHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+  header.version = CHECKPOINT_VERSION;
+  header.size = info.size;
+  header.seed = info.seed;
+  header.iteration = info.iteration;
+  header.planes = CHECKPOINT_PLANES;
+
+  std::string partial = path + ".partial";
+  std::ofstream file(partial, std::ios::binary);
+  file.write((const char*)&header, sizeof(header));
+  file.write((const char*)&planes[0], std::streamsize(planes.size() * sizeof(float)));
+  file.close();
+
+  //rename() will not replace an existing file everywhere
+  bool written = bool(file);
+  if(written && std::rename(partial.c_str(), path.c_str()) != 0)
+  {
+    std::remove(path.c_str());
+    written = std::rename(partial.c_str(), path.c_str()) == 0;
+  }
+  if(!written)
+    failed = true;
+}
+
+bool readCheckpointHeader(std::ifstream& file, CheckpointHeader& header)
+{
+  file.read((char*)&header, sizeof(header));
+  return bool(file) && memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0 &&
+         header.version == CHECKPOINT_VERSION && header.planes == CHECKPOINT_PLANES && header.size > 1;
+}
+
+bool readCheckpointInfo(const std::string& path, CheckpointInfo& info)
+{
+  std::ifstream file(path, std::ios::binary);
+  CheckpointHeader header;
+  if(!readCheckpointHeader(file, header))
+    return false;
+
+  info.size = header.size;
+  info.seed = header.seed;
+  info.iteration = header.iteration;
+  return true;
+}
+
+bool loadCheckpoint(const std::string& path, ErosionGrid& sim)
+{
+  std::ifstream file(path, std::ios::binary);
+  CheckpointHeader header;
+  if(!readCheckpointHeader(file, header) || header.size != sim.size)
+    return false;
+
+  size_t cells = size_t(sim.size) * sim.size;
+  std::vector<float> dense(cells);
+
+  for(int p = 0; p < CHECKPOINT_PLANES; p++)
+  {
+    if(!file.read((char*)&dense[0], std::streamsize(cells * sizeof(float))))
+      return false;
+    loadCheckpointPlane(sim, p, &dense[0]);
+  }
+  return true;
+}
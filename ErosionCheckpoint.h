@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ErosionGrid;
+
+//what a checkpoint file holds besides the cell planes
+struct CheckpointInfo
+{
+  CheckpointInfo() : size(0), seed(0), iteration(0) {}
+
+  int size;
+
+  //rainfall is drawn from (seed, iteration, x, y), so these two are the whole random state
+  uint64_t seed;
+
+  //iterations finished, the run resumes at this one
+  int iteration;
+};
+
+//a checkpoint file is a header followed by the planes that carry over from one iteration to the next
+//(b, d, s and the four flux planes) as size * size floats each, in the byte order of the machine writing it;
+//every other plane is rewritten before it is read in each iteration
+//planes are always saved as floats, so a checkpoint resumes at either precision (ErosionSettings::halfPrecision)
+
+//writes checkpoints of a running simulation on a background thread
+//save() copies the planes into a buffer and returns, the copy is written out while the simulation goes on;
+//each file is written beside the target and renamed over it, so an interrupted write leaves the last one whole
+class CheckpointWriter
+{
+public:
+  CheckpointWriter(const std::string& path);
+
+  //waits for the write in flight
+  ~CheckpointWriter();
+
+  //waits for the previous write if it has not finished yet
+  void save(const ErosionGrid& sim, uint64_t seed, int iteration);
+
+  //waits for the write in flight, returns whether every write so far succeeded
+  bool finish();
+
+private:
+  CheckpointWriter(const CheckpointWriter&);
+  CheckpointWriter& operator=(const CheckpointWriter&);
+
+  void write();
+
+  std::string path;
+  std::thread worker;
+  std::vector<float> planes;
+  CheckpointInfo info;
+  bool failed;
+};
+
+bool readCheckpointInfo(const std::string& path, CheckpointInfo& info);
+
+//loads the planes into a grid of the size in the file
+bool loadCheckpoint(const std::string& path, ErosionGrid& sim);
@@ -0,0 +1,190 @@
+#include <algorithm>
+#include <cfloat>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "ErosionGrid.h"
+
+const size_t PLANE_ALIGNMENT = 64;
+
+float* allocPlane(size_t count)
+{
+  void* mem = NULL;
+#ifdef _WIN32
+  mem = _aligned_malloc(count * sizeof(float), PLANE_ALIGNMENT);
+#else
+  if(posix_memalign(&mem, PLANE_ALIGNMENT, count * sizeof(float)) != 0)
+    mem = NULL;
+#endif
+  if(mem == NULL)
+    throw std::bad_alloc();
+
+  memset(mem, 0, count * sizeof(float));
+  return (float*)mem;
+}
+
+void freePlane(float* plane)
+{
+#ifdef _WIN32
+  _aligned_free(plane);
+#else
+  free(plane);
+#endif
+}
+
+const int ROW_ALIGNMENT = int(PLANE_ALIGNMENT / sizeof(float));
+
+//scales of the half state planes
+//flux runs to about 1e-4 and would sit mostly in the half subnormals, sediment stays under 0.1;
+//flux over 0.0625 scaled becomes infinity, which validation stops on
+const float FLUX_SCALE = 1 << 20;
+const float SEDIMENT_SCALE = 1 << 8;
+const float VELOCITY_SCALE = 1;
+
+ErosionGrid::ErosionGrid(int size, bool halfPrecision) : size(size), halfPrecision(halfPrecision)
+{
+  stride = (size + 2 + ROW_ALIGNMENT - 1) / ROW_ALIGNMENT * ROW_ALIGNMENT;
+
+  b = allocGridPlane();
+  b1 = allocGridPlane();
+  d = allocGridPlane();
+  d2 = allocGridPlane();
+  allocStatePlane(s, SEDIMENT_SCALE);
+  s1 = allocGridPlane();
+  for(int j = 0; j < 4; j++)
+    allocStatePlane(f[j], FLUX_SCALE);
+  allocStatePlane(u, VELOCITY_SCALE);
+  allocStatePlane(v, VELOCITY_SCALE);
+  slope = allocGridPlane();
+  slopeDirty = allocBytePlane();
+  invalidateSlopes(0, size, 0, size);
+
+  //wall the grid in, so no water flows past the edge
+  fillBorder(b, FLT_MAX);
+  fillBorder(b1, FLT_MAX);
+}
+
+ErosionGrid::~ErosionGrid()
+{
+  freeGridPlane(b);
+  freeGridPlane(b1);
+  freeGridPlane(d);
+  freeGridPlane(d2);
+  freeStatePlane(s);
+  freeGridPlane(s1);
+  for(int j = 0; j < 4; j++)
+    freeStatePlane(f[j]);
+  freeStatePlane(u);
+  freeStatePlane(v);
+  freeGridPlane(slope);
+  freeBytePlane(slopeDirty);
+}
+
+//planes point at cell (0, 0), one row and one column past the start of the allocation
+float* ErosionGrid::allocGridPlane()
+{
+  return allocPlane(size_t(size + 2) * stride) + stride + 1;
+}
+
+void ErosionGrid::freeGridPlane(float* plane)
+{
+  freePlane(plane - stride - 1);
+}
+
+//half planes have the same layout as float planes in half the bytes
+void ErosionGrid::allocStatePlane(StatePlane& plane, float scale)
+{
+  if(halfPrecision)
+  {
+    size_t count = size_t(size + 2) * stride;
+    plane.half = (uint16_t*)allocPlane((count + 1) / 2) + stride + 1;
+    plane.scale = scale;
+  }
+  else
+    plane.full = allocGridPlane();
+}
+
+uint8_t* ErosionGrid::allocBytePlane()
+{
+  size_t count = size_t(size + 2) * stride;
+  return (uint8_t*)allocPlane((count + 3) / 4) + stride + 1;
+}
+
+void ErosionGrid::freeBytePlane(uint8_t* plane)
+{
+  freePlane((float*)(plane - stride - 1));
+}
+
+void ErosionGrid::freeStatePlane(StatePlane& plane)
+{
+  if(plane.half != NULL)
+    freePlane((float*)(plane.half - stride - 1));
+  else
+    freeGridPlane(plane.full);
+}
+
+void ErosionGrid::fillBorder(float* plane, float value)
+{
+  std::fill(plane + index(-1, -1), plane + index(size + 1, -1), value);
+  std::fill(plane + index(-1, size), plane + index(size + 1, size), value);
+  for(int y = 0; y < size; y++)
+  {
+    plane[index(-1, y)] = value;
+    plane[index(size, y)] = value;
+  }
+}
+
+void ErosionGrid::load(float* plane, const float* dense) const
+{
+  for(int y = 0; y < size; y++)
+    std::copy(dense + size_t(y) * size, dense + size_t(y + 1) * size, plane + index(0, y));
+}
+
+void ErosionGrid::store(const float* plane, float* dense) const
+{
+  for(int y = 0; y < size; y++)
+    std::copy(plane + index(0, y), plane + index(size, y), dense + size_t(y) * size);
+}
+
+void ErosionGrid::load(StatePlane& plane, const float* dense) const
+{
+  if(plane.full != NULL)
+  {
+    load(plane.full, dense);
+    return;
+  }
+
+  for(int y = 0; y < size; y++)
+  {
+    for(int x = 0; x < size; x++)
+      plane.set(index(x, y), dense[size_t(y) * size + x]);
+  }
+}
+
+void ErosionGrid::store(const StatePlane& plane, float* dense) const
+{
+  if(plane.full != NULL)
+  {
+    store(plane.full, dense);
+    return;
+  }
+
+  for(int y = 0; y < size; y++)
+  {
+    for(int x = 0; x < size; x++)
+      dense[size_t(y) * size + x] = plane.get(index(x, y));
+  }
+}
+
+void ErosionGrid::swapBuffers()
+{
+  std::swap(b, b1);
+  std::swap(d, d2);
+}
+
+void ErosionGrid::invalidateSlopes(int x0, int x1, int y0, int y1)
+{
+  for(int y = y0; y < y1; y++)
+    std::fill(slopeDirty + index(x0, y), slopeDirty + index(x1, y), 1);
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+
+#include "half.h"
+
+//allocates a zeroed float plane aligned to a cache line
+float* allocPlane(size_t count);
+void freePlane(float* plane);
+
+//one plane of secondary state (sediment, flux or velocity), held as floats or as half floats
+//half planes hold value * scale, a power of two, which lifts small values clear of the half subnormals
+//and is undone exactly on the way back to float
+struct StatePlane
+{
+  StatePlane() : full(NULL), half(NULL), scale(1) {}
+
+  float get(ptrdiff_t i) const { return full != NULL ? full[i] : halfToFloat(half[i]) / scale; }
+  void set(ptrdiff_t i, float value)
+  {
+    if(full != NULL)
+      full[i] = value;
+    else
+      half[i] = floatToHalf(value * scale);
+  }
+
+  //the plane as float or uint16_t, NULL if it is held the other way
+  template<class T>
+  T* data() const;
+
+  float* full;
+  uint16_t* half;
+  float scale;
+};
+
+template<>
+inline float* StatePlane::data<float>() const { return full; }
+
+template<>
+inline uint16_t* StatePlane::data<uint16_t>() const { return half; }
+
+//structure-of-arrays simulation state used by erodeField()
+//every plane is one contiguous row-major block with a one cell ghost border,
+//so x and y run from -1 to size and neighbours of edge cells can be read without bounds checks
+//the border of both terrain planes is a wall of height FLT_MAX, every other plane starts out all zero
+//terrain and water are always floats, with halfPrecision set the state carried between iterations
+//(sediment and flux) and the velocity are half floats
+struct ErosionGrid
+{
+  ErosionGrid(int size, bool halfPrecision = false);
+  ~ErosionGrid();
+
+  //offset of cell (x, y) into any plane
+  ptrdiff_t index(int x, int y) const { return x + ptrdiff_t(y) * stride; }
+
+  //sets the ghost border of a plane, leaving the size * size cells inside untouched
+  void fillBorder(float* plane, float value);
+
+  //copy size * size cells between a plane and a dense row-major array
+  void load(float* plane, const float* dense) const;
+  void store(const float* plane, float* dense) const;
+  void load(StatePlane& plane, const float* dense) const;
+  void store(const StatePlane& plane, float* dense) const;
+
+  //Step 8 of a dense iteration: the new terrain and water become the current ones, and the old planes
+  //are written over by the next iteration
+  void swapBuffers();
+
+  //marks the slopes of cells [x0, x1) of rows [y0, y1) out of date, for when b has been written from outside
+  //the simulation, or changed without Step 5 marking them
+  void invalidateSlopes(int x0, int x1, int y0, int y1);
+
+  int size;
+
+  //distance between rows, padded past size + 2 to keep rows cache line sized
+  int stride;
+
+  bool halfPrecision;
+
+  //terrain height, b1 is the terrain after Step 5
+  float* b;
+  float* b1;
+
+  //water height, rained on in place by Step 1 (so d holds d1 until Step 8), d2 is the water after Step 3
+  float* d;
+  float* d2;
+
+  //suspended sediment, s1 is the sediment after Step 5, which only lives until Step 6 and is always float
+  StatePlane s;
+  float* s1;
+
+  //outflow flux (LEFT, RIGHT, TOP, BOTTOM)
+  StatePlane f[4];
+
+  //velocity
+  StatePlane u;
+  StatePlane v;
+
+  //sine of the terrain slope Step 5 works out from b around each cell, kept between iterations
+  //slopeDirty is set on every cell whose b, or b of a neighbour, has changed since its slope was worked out
+  float* slope;
+  uint8_t* slopeDirty;
+
+private:
+  float* allocGridPlane();
+  void freeGridPlane(float* plane);
+  uint8_t* allocBytePlane();
+  void freeBytePlane(uint8_t* plane);
+  void allocStatePlane(StatePlane& plane, float scale);
+  void freeStatePlane(StatePlane& plane);
+
+  ErosionGrid(const ErosionGrid&);
+  ErosionGrid& operator=(const ErosionGrid&);
+};
+
+//bytes of an ErosionGrid per cell, ignoring the ghost border and row padding: the float planes b, b1, d, d2, s1
+//and slope, the seven state planes s, f and u, v as floats or half floats, and slopeDirty
+//keep these in step with the planes above, the benchmark and the batch memory budget count on them
+const int EROSION_GRID_BYTES_PER_CELL = 6 * 4 + 7 * 4 + 1;
+const int EROSION_GRID_HALF_BYTES_PER_CELL = 6 * 4 + 7 * 2 + 1;
@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include "ErosionTrace.h"
+
+ErosionTrace::ErosionTrace() : origin(std::chrono::steady_clock::now())
+{
+}
+
+ErosionTrace::Iteration& ErosionTrace::at(int iteration)
+{
+  if(iterations.empty() || iterations.back().iteration != iteration)
+  {
+    Iteration record;
+    record.iteration = iteration;
+    for(int step = 0; step < STEP_COUNT; step++)
+    {
+      record.stepStart[step] = 0;
+      record.stepDuration[step] = 0;
+    }
+    iterations.push_back(record);
+  }
+  return iterations.back();
+}
+
+void ErosionTrace::recordStep(int iteration, int step, std::chrono::steady_clock::time_point start, double seconds)
+{
+  Iteration& record = at(iteration);
+  record.stepStart[step] = std::chrono::duration<double, std::micro>(start - origin).count();
+  record.stepDuration[step] = seconds * 1e6;
+}
+
+void ErosionTrace::recordCounters(int iteration, const ErosionCounters& counters)
+{
+  at(iteration).counters = counters;
+}
+
+//a counter as a JSON number, or null for the NaN or infinity a failed run leaves behind
+std::string jsonNumber(double value)
+{
+  if(!std::isfinite(value))
+    return "null";
+
+  std::ostringstream number;
+  number << value;
+  return number.str();
+}
+
+bool ErosionTrace::writeChromeTrace(const std::string& path) const
+{
+  std::ofstream json(path);
+  if(!json)
+    return false;
+
+  //timestamps are in microseconds, written to the nanosecond so long runs keep their step order
+  json << std::fixed << std::setprecision(3);
+  json << "{\"traceEvents\": [\n";
+  bool first = true;
+
+  for(size_t i = 0; i < iterations.size(); i++)
+  {
+    const Iteration& record = iterations[i];
+    double end = 0;
+
+    for(int step = 0; step < STEP_COUNT; step++)
+    {
+      json << (first ? "" : ",\n") << "{\"name\": \"" << erosionStepName(step) << "\", \"cat\": \"erosion\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1"
+           << ", \"ts\": " << record.stepStart[step] << ", \"dur\": " << record.stepDuration[step]
+           << ", \"args\": {\"iteration\": " << record.iteration << "}}";
+      first = false;
+      end = std::max(end, record.stepStart[step] + record.stepDuration[step]);
+    }
+
+    const ErosionCounters& c = record.counters;
+    json << ",\n{\"name\": \"volume\", \"ph\": \"C\", \"pid\": 1, \"ts\": " << end
+         << ", \"args\": {\"water\": " << jsonNumber(c.water) << ", \"sediment\": " << jsonNumber(c.sediment) << "}}";
+    json << ",\n{\"name\": \"erosion\", \"ph\": \"C\", \"pid\": 1, \"ts\": " << end
+         << ", \"args\": {\"eroded\": " << jsonNumber(c.eroded) << ", \"deposited\": " << jsonNumber(c.deposited) << "}}";
+    json << ",\n{\"name\": \"wet cells\", \"ph\": \"C\", \"pid\": 1, \"ts\": " << end
+         << ", \"args\": {\"cells\": " << c.wetCells << "}}";
+    json << ",\n{\"name\": \"max flux\", \"ph\": \"C\", \"pid\": 1, \"ts\": " << end
+         << ", \"args\": {\"flux\": " << jsonNumber(c.maxFlux) << "}}";
+  }
+
+  json << "\n]}\n";
+  return bool(json);
+}
+
+bool ErosionTrace::writeCsv(const std::string& path) const
+{
+  std::ofstream csv(path);
+  if(!csv)
+    return false;
+
+  csv << "iteration";
+  for(int step = 0; step < STEP_COUNT; step++)
+    csv << "," << erosionStepName(step) << " ms";
+  csv << ",water,sediment,eroded,deposited,wet cells,max flux\n";
+
+  for(size_t i = 0; i < iterations.size(); i++)
+  {
+    const Iteration& record = iterations[i];
+    const ErosionCounters& c = record.counters;
+
+    csv << record.iteration;
+    for(int step = 0; step < STEP_COUNT; step++)
+      csv << "," << record.stepDuration[step] / 1000;
+    csv << "," << c.water << "," << c.sediment << "," << c.eroded << "," << c.deposited << "," << c.wetCells << "," << c.maxFlux << "\n";
+  }
+
+  return bool(csv);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "Erosion.h"
+
+//aggregate state of the simulation at the end of one iteration
+struct ErosionCounters
+{
+  ErosionCounters() : water(0), sediment(0), eroded(0), deposited(0), wetCells(0), maxFlux(0) {}
+
+  //total water height and suspended sediment over every cell
+  double water;
+  double sediment;
+
+  //terrain height taken up and laid down by Step 5 this iteration
+  double eroded;
+  double deposited;
+
+  //cells holding more than a trace of water
+  long long wetCells;
+
+  //largest outflow through any pipe
+  float maxFlux;
+};
+
+//per-step wall time and counters of every iteration of a traced erodeField() run
+//attach through ErosionSettings::trace; the hooks are only compiled into Erosion.cpp when EROSION_TRACE is
+//defined, otherwise they are left out entirely and an attached trace stays empty
+//a traced run times its steps one by one (see ErosionSettings::profile), fused or not
+class ErosionTrace
+{
+public:
+  ErosionTrace();
+
+  void recordStep(int iteration, int step, std::chrono::steady_clock::time_point start, double seconds);
+  void recordCounters(int iteration, const ErosionCounters& counters);
+
+  //Chrome trace event format (chrome://tracing, Perfetto): steps as complete events, counters as counter tracks
+  bool writeChromeTrace(const std::string& path) const;
+
+  //one row per iteration: step times in milliseconds, then the counters
+  bool writeCsv(const std::string& path) const;
+
+  struct Iteration
+  {
+    int iteration;
+
+    //microseconds since the trace was created
+    double stepStart[STEP_COUNT];
+    double stepDuration[STEP_COUNT];
+
+    ErosionCounters counters;
+  };
+
+  std::vector<Iteration> iterations;
+
+private:
+  Iteration& at(int iteration);
+
+  std::chrono::steady_clock::time_point origin;
+};
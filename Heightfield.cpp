@@ -0,0 +1,396 @@
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "Heightfield.h"
+#include "ThreadPool.h"
+
+const char HEIGHTFIELD_MAGIC[8] = {'H', 'F', 'I', 'E', 'L', 'D', 0, 0};
+const uint32_t HEIGHTFIELD_VERSION = 1;
+
+//header page, the tiles start on the next page so each tile can be mapped on its own
+const size_t HEADER_BYTES = 4096;
+
+struct HeightfieldHeader
+{
+  char magic[8];
+  uint32_t version;
+  int32_t size;
+  int32_t tileSize;
+  int32_t channels;
+  int32_t levels;
+};
+
+//mip rows are filtered in chunks of this many, one chunk per task
+const int MIP_ROWS_PER_TASK = 16;
+
+Heightfield::Heightfield()
+  : cellsPerSide(0), tileSize(0), channels(0), levels(0), mapping(NULL), mappedBytes(0)
+{
+#ifdef _WIN32
+  fileHandle = INVALID_HANDLE_VALUE;
+  mappingHandle = NULL;
+#else
+  fileHandle = -1;
+#endif
+}
+
+Heightfield::~Heightfield()
+{
+  close();
+}
+
+void Heightfield::setLayout(int size, int tileSize, int channels)
+{
+  cellsPerSide = size;
+  this->tileSize = tileSize;
+  this->channels = channels;
+
+  levels = 1;
+  while(levels < 32 && this->size(levels - 1) > 2)
+    levels++;
+
+  size_t tileBytes = size_t(tileSize) * tileSize * sizeof(float);
+  size_t offset = HEADER_BYTES;
+  for(int level = 0; level < levels; level++)
+  {
+    levelStart[level] = offset;
+    offset += size_t(channels) * tilesPerSide(level) * tilesPerSide(level) * tileBytes;
+  }
+  mappedBytes = offset;
+}
+
+//layouts create() accepts, and so the only ones open() trusts a header to hold
+bool validLayout(int size, int tileSize, int channels)
+{
+  return size >= 2 && tileSize >= 32 && (tileSize & (tileSize - 1)) == 0 && channels >= 1;
+}
+
+bool Heightfield::create(const std::string& path, int size, int tileSize, int channels)
+{
+  close();
+
+  if(!validLayout(size, tileSize, channels))
+    return false;
+
+  setLayout(size, tileSize, channels);
+  if(!map(path, mappedBytes, true, true))
+    return false;
+
+  HeightfieldHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, HEIGHTFIELD_MAGIC, sizeof(header.magic));
+  header.version = HEIGHTFIELD_VERSION;
+  header.size = size;
+  header.tileSize = tileSize;
+  header.channels = channels;
+  header.levels = levels;
+  memcpy(mapping, &header, sizeof(header));
+
+  return true;
+}
+
+bool Heightfield::open(const std::string& path, bool writable)
+{
+  close();
+
+  //map just the header first to learn the layout
+  if(!map(path, HEADER_BYTES, writable, false))
+    return false;
+
+  HeightfieldHeader header;
+  memcpy(&header, mapping, sizeof(header));
+  close();
+
+  if(memcmp(header.magic, HEIGHTFIELD_MAGIC, sizeof(header.magic)) != 0 || header.version != HEIGHTFIELD_VERSION)
+    return false;
+  if(!validLayout(header.size, header.tileSize, header.channels))
+    return false;
+
+  setLayout(header.size, header.tileSize, header.channels);
+  if(levels != header.levels)
+    return false;
+
+  return map(path, mappedBytes, writable, false);
+}
+
+#ifdef _WIN32
+
+bool Heightfield::map(const std::string& path, size_t bytes, bool writable, bool creating)
+{
+  DWORD access = writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ;
+  HANDLE file = CreateFileA(path.c_str(), access, FILE_SHARE_READ, NULL, creating ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if(file == INVALID_HANDLE_VALUE)
+    return false;
+
+  LARGE_INTEGER existing;
+  if(!creating && (!GetFileSizeEx(file, &existing) || uint64_t(existing.QuadPart) < bytes))
+  {
+    CloseHandle(file);
+    return false;
+  }
+
+  //mapping a new file past its end grows it, zero-filled
+  uint64_t length = bytes;
+  HANDLE view = CreateFileMappingA(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, DWORD(length >> 32), DWORD(length), NULL);
+  if(view == NULL)
+  {
+    CloseHandle(file);
+    return false;
+  }
+
+  void* mem = MapViewOfFile(view, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, bytes);
+  if(mem == NULL)
+  {
+    CloseHandle(view);
+    CloseHandle(file);
+    return false;
+  }
+
+  fileHandle = file;
+  mappingHandle = view;
+  mapping = (unsigned char*)mem;
+  mappedBytes = bytes;
+  return true;
+}
+
+void Heightfield::flush()
+{
+  if(mapping != NULL)
+  {
+    FlushViewOfFile(mapping, mappedBytes);
+    FlushFileBuffers(fileHandle);
+  }
+}
+
+void Heightfield::close()
+{
+  if(mapping != NULL)
+    UnmapViewOfFile(mapping);
+  if(mappingHandle != NULL)
+    CloseHandle(mappingHandle);
+  if(fileHandle != INVALID_HANDLE_VALUE)
+    CloseHandle(fileHandle);
+
+  mapping = NULL;
+  mappingHandle = NULL;
+  fileHandle = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+bool Heightfield::map(const std::string& path, size_t bytes, bool writable, bool creating)
+{
+  int flags = writable ? O_RDWR : O_RDONLY;
+  if(creating)
+    flags |= O_CREAT | O_TRUNC;
+
+  int file = ::open(path.c_str(), flags, 0644);
+  if(file < 0)
+    return false;
+
+  struct stat info;
+  bool ok = fstat(file, &info) == 0;
+  if(ok && creating)
+    ok = ftruncate(file, off_t(bytes)) == 0;
+  else if(ok)
+    ok = size_t(info.st_size) >= bytes;
+
+  void* mem = MAP_FAILED;
+  if(ok)
+    mem = mmap(NULL, bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file, 0);
+  if(mem == MAP_FAILED)
+  {
+    ::close(file);
+    return false;
+  }
+
+  fileHandle = file;
+  mapping = (unsigned char*)mem;
+  mappedBytes = bytes;
+  return true;
+}
+
+void Heightfield::flush()
+{
+  if(mapping != NULL)
+    msync(mapping, mappedBytes, MS_SYNC);
+}
+
+void Heightfield::close()
+{
+  if(mapping != NULL)
+    munmap(mapping, mappedBytes);
+  if(fileHandle >= 0)
+    ::close(fileHandle);
+
+  mapping = NULL;
+  fileHandle = -1;
+}
+
+#endif
+
+bool Heightfield::isOpen() const
+{
+  return mapping != NULL;
+}
+
+int Heightfield::size(int level) const
+{
+  return ((cellsPerSide - 1) >> level) + 1;
+}
+
+int Heightfield::getTileSize() const
+{
+  return tileSize;
+}
+
+int Heightfield::tilesPerSide(int level) const
+{
+  return (size(level) + tileSize - 1) / tileSize;
+}
+
+int Heightfield::channelCount() const
+{
+  return channels;
+}
+
+int Heightfield::levelCount() const
+{
+  return levels;
+}
+
+size_t Heightfield::tileOffset(int channel, int level, int tx, int ty) const
+{
+  size_t tiles = tilesPerSide(level);
+  size_t tileIndex = (size_t(channel) * tiles + ty) * tiles + tx;
+  return levelStart[level] + tileIndex * tileSize * tileSize * sizeof(float);
+}
+
+float* Heightfield::tile(int channel, int level, int tx, int ty)
+{
+  return (float*)(mapping + tileOffset(channel, level, tx, ty));
+}
+
+const float* Heightfield::tile(int channel, int level, int tx, int ty) const
+{
+  return (const float*)(mapping + tileOffset(channel, level, tx, ty));
+}
+
+//both copy one row at a time, in spans that stay inside one tile
+void Heightfield::readRegion(int channel, int level, int x0, int y0, int width, int height, float* dst, ptrdiff_t stride) const
+{
+  for(int y = 0; y < height; y++)
+  {
+    int cellY = y0 + y;
+    float* out = dst + y * stride;
+
+    for(int x = 0; x < width;)
+    {
+      int cellX = x0 + x;
+      int span = std::min(width - x, tileSize - cellX % tileSize);
+      const float* src = tile(channel, level, cellX / tileSize, cellY / tileSize) + size_t(cellY % tileSize) * tileSize + cellX % tileSize;
+
+      std::copy(src, src + span, out + x);
+      x += span;
+    }
+  }
+}
+
+void Heightfield::writeRegion(int channel, int level, int x0, int y0, int width, int height, const float* src, ptrdiff_t stride)
+{
+  for(int y = 0; y < height; y++)
+  {
+    int cellY = y0 + y;
+    const float* in = src + y * stride;
+
+    for(int x = 0; x < width;)
+    {
+      int cellX = x0 + x;
+      int span = std::min(width - x, tileSize - cellX % tileSize);
+      float* out = tile(channel, level, cellX / tileSize, cellY / tileSize) + size_t(cellY % tileSize) * tileSize + cellX % tileSize;
+
+      std::copy(in + x, in + x + span, out);
+      x += span;
+    }
+  }
+}
+
+//filters rows [y0, y1) of level + 1 from level: cell (x, y) is the 1 2 1 weighted average of the
+//3 * 3 cells around (2x, 2y), renormalised where they run off the edge
+void filterMipRows(Heightfield& field, int channel, int level, int y0, int y1)
+{
+  int srcSize = field.size(level);
+  int dstSize = field.size(level + 1);
+  std::vector<float> rows(size_t(3) * srcSize);
+  std::vector<float> across(size_t(3) * dstSize);
+  std::vector<float> out(dstSize);
+
+  for(int y = y0; y < y1; y++)
+  {
+    float weightSum = 0;
+    for(int r = 0; r < 3; r++)
+    {
+      int srcY = 2 * y + r - 1;
+      float* filtered = &across[size_t(r) * dstSize];
+      if(srcY < 0 || srcY >= srcSize)
+      {
+        std::fill(filtered, filtered + dstSize, 0.0f);
+        continue;
+      }
+
+      float* row = &rows[size_t(r) * srcSize];
+      field.readRegion(channel, level, 0, srcY, srcSize, 1, row, srcSize);
+      weightSum += r == 1 ? 2 : 1;
+
+      for(int x = 0; x < dstSize; x++)
+      {
+        int centre = 2 * x;
+        float sum = 2 * row[centre];
+        float weights = 2;
+        if(centre > 0)
+        {
+          sum += row[centre - 1];
+          weights += 1;
+        }
+        if(centre < srcSize - 1)
+        {
+          sum += row[centre + 1];
+          weights += 1;
+        }
+        filtered[x] = sum / weights;
+      }
+    }
+
+    for(int x = 0; x < dstSize; x++)
+      out[x] = (across[x] + 2 * across[dstSize + x] + across[2 * dstSize + x]) / weightSum;
+
+    field.writeRegion(channel, level + 1, 0, y, dstSize, 1, &out[0], dstSize);
+  }
+}
+
+void Heightfield::buildMips(int channel, int threads)
+{
+  ThreadPool pool(threads);
+
+  for(int level = 0; level + 1 < levels; level++)
+  {
+    int rows = size(level + 1);
+    int tasks = (rows + MIP_ROWS_PER_TASK - 1) / MIP_ROWS_PER_TASK;
+
+    pool.parallelFor(tasks, [&](int task)
+    {
+      int y0 = task * MIP_ROWS_PER_TASK;
+      filterMipRows(*this, channel, level, y0, std::min(rows, y0 + MIP_ROWS_PER_TASK));
+    });
+  }
+}
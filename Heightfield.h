@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+
+//channels stored in a heightfield file
+enum HeightfieldChannel
+{
+  CHANNEL_HEIGHT = 0,
+  CHANNEL_WATER = 1,
+  CHANNEL_SEDIMENT = 2
+};
+
+//memory-mapped heightfield file, so a tool only pages in the tiles it touches
+//layout: a 4096 byte header page, then for each mip level, for each channel, the tiles of that level in
+//row-major order, each tileSize * tileSize floats (host byte order) with cells past the edge left at zero
+//level 0 is size * size cells, every further level halves the cells between samples, down to 2 * 2
+class Heightfield
+{
+public:
+  Heightfield();
+  ~Heightfield();
+
+  //creates (or overwrites) a zero-filled file, tileSize must be a power of two of at least 32
+  bool create(const std::string& path, int size, int tileSize, int channels);
+  bool open(const std::string& path, bool writable);
+  void close();
+  bool isOpen() const;
+
+  //writes dirty pages back to disk
+  void flush();
+
+  int size(int level = 0) const;
+  int getTileSize() const;
+  int tilesPerSide(int level = 0) const;
+  int channelCount() const;
+  int levelCount() const;
+
+  //tileSize * tileSize row-major cells of one tile, straight into the mapping
+  float* tile(int channel, int level, int tx, int ty);
+  const float* tile(int channel, int level, int tx, int ty) const;
+
+  //copy a width * height rectangle starting at cell (x0, y0) to or from memory, rows stride floats apart
+  void readRegion(int channel, int level, int x0, int y0, int width, int height, float* dst, ptrdiff_t stride) const;
+  void writeRegion(int channel, int level, int x0, int y0, int width, int height, const float* src, ptrdiff_t stride);
+
+  //recomputes every level above 0 of a channel from the one below it with a 3 * 3 tent filter
+  void buildMips(int channel, int threads = 1);
+
+private:
+  Heightfield(const Heightfield&);
+  Heightfield& operator=(const Heightfield&);
+
+  bool map(const std::string& path, size_t bytes, bool writable, bool creating);
+  void setLayout(int size, int tileSize, int channels);
+  size_t tileOffset(int channel, int level, int tx, int ty) const;
+
+  int cellsPerSide;
+  int tileSize;
+  int channels;
+  int levels;
+
+  //byte offset of each level's tiles
+  size_t levelStart[32];
+
+  unsigned char* mapping;
+  size_t mappedBytes;
+
+#ifdef _WIN32
+  void* fileHandle;
+  void* mappingHandle;
+#else
+  int fileHandle;
+#endif
+};
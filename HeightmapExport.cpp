@@ -0,0 +1,224 @@
+#include <algorithm>
+
+#include "HeightmapExport.h"
+
+using namespace std;
+
+HeightmapExport::HeightmapExport(int encodeThreads, int bufferCount, size_t bufferBytes)
+  : bufferBytes(bufferBytes), closing(0), failed(0), stopping(false)
+{
+  bufferCount = max(bufferCount, 1);
+  buffers.resize(bufferCount);
+  for(int i = 0; i < bufferCount; i++)
+    freeBuffers.push_back(i);
+
+  for(int i = 0; i < max(encodeThreads, 1); i++)
+    encoders.push_back(thread(&HeightmapExport::encodeLoop, this));
+  writer = thread(&HeightmapExport::writeLoop, this);
+}
+
+HeightmapExport::~HeightmapExport()
+{
+  for(size_t i = 0; i < files.size(); i++)
+    close(int(i));
+  finish();
+
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  encodeReady.notify_all();
+  writeReady.notify_all();
+
+  for(size_t i = 0; i < encoders.size(); i++)
+    encoders[i].join();
+  writer.join();
+}
+
+int HeightmapExport::open(const string& name, int width, int height, HeightmapFormat format)
+{
+  ExportFile* f = new ExportFile;
+  f->stream.open(name, ios::binary);
+  string header = heightmapHeader(width, height, format);
+  f->stream << header;
+  if(!f->stream)
+  {
+    delete f;
+    return -1;
+  }
+
+  f->width = width;
+  f->format = format;
+  f->headerBytes = header.size();
+  f->rowBytes = size_t(width) * heightmapSampleBytes(format);
+  f->pending = 0;
+  f->closed = false;
+  f->ok = true;
+
+  lock_guard<mutex> guard(lock);
+  files.push_back(f);
+  return int(files.size()) - 1;
+}
+
+void HeightmapExport::writeRows(int file, const float* rows, int y, int count)
+{
+  {
+    lock_guard<mutex> guard(lock);
+    ExportFile* f = files[file];
+
+    //chunks as big as a buffer holds, so each is one large write
+    int chunkRows = int(max(bufferBytes / f->rowBytes, size_t(1)));
+    for(int start = 0; start < count; start += chunkRows)
+    {
+      EncodeTask task;
+      task.file = file;
+      task.rows = rows + size_t(start) * f->width;
+      task.y = y + start;
+      task.count = min(chunkRows, count - start);
+      encodeTasks.push_back(task);
+      f->pending++;
+    }
+  }
+  encodeReady.notify_all();
+}
+
+void HeightmapExport::flush(int file)
+{
+  unique_lock<mutex> guard(lock);
+  written.wait(guard, [&] { return files[file] == NULL || files[file]->pending == 0; });
+}
+
+void HeightmapExport::close(int file, const function<void(bool)>& done)
+{
+  ExportFile* f;
+  {
+    lock_guard<mutex> guard(lock);
+    f = files[file];
+    if(f == NULL || f->closed)
+      return;
+
+    f->closed = true;
+    f->done = done;
+    closing++;
+    if(f->pending > 0)
+      return;
+    f = retire(file);
+  }
+  complete(f);
+}
+
+bool HeightmapExport::finish()
+{
+  unique_lock<mutex> guard(lock);
+  written.wait(guard, [&] { return closing == 0; });
+  bool ok = failed == 0;
+  failed = 0;
+  return ok;
+}
+
+HeightmapExport::ExportFile* HeightmapExport::retire(int file)
+{
+  ExportFile* f = files[file];
+  files[file] = NULL;
+  return f;
+}
+
+void HeightmapExport::complete(ExportFile* f)
+{
+  f->stream.close();
+  bool ok = f->ok && !f->stream.fail();
+  if(f->done)
+    f->done(ok);
+  delete f;
+
+  {
+    lock_guard<mutex> guard(lock);
+    closing--;
+    if(!ok)
+      failed++;
+  }
+  written.notify_all();
+}
+
+void HeightmapExport::encodeLoop()
+{
+  for(;;)
+  {
+    EncodeTask task;
+    int buffer;
+    ExportFile* f;
+    {
+      unique_lock<mutex> guard(lock);
+      encodeReady.wait(guard, [&] { return !encodeTasks.empty() || stopping; });
+      if(encodeTasks.empty())
+        return;
+
+      task = encodeTasks.front();
+      encodeTasks.pop_front();
+
+      bufferFree.wait(guard, [&] { return !freeBuffers.empty(); });
+      buffer = freeBuffers.back();
+      freeBuffers.pop_back();
+      f = files[task.file];
+    }
+
+    //a chunk only outgrows its buffer when a single row is bigger than bufferBytes
+    vector<unsigned char>& out = buffers[buffer];
+    size_t bytes = size_t(task.count) * f->rowBytes;
+    if(out.size() < bytes)
+      out.resize(max(bytes, bufferBytes));
+
+    for(int y = 0; y < task.count; y++)
+      encodeHeightmapRow(task.rows + size_t(y) * f->width, f->width, f->format, &out[y * f->rowBytes]);
+
+    WriteTask write;
+    write.file = task.file;
+    write.offset = f->headerBytes + size_t(task.y) * f->rowBytes;
+    write.buffer = buffer;
+    write.bytes = bytes;
+    {
+      lock_guard<mutex> guard(lock);
+      writeTasks.push_back(write);
+    }
+    writeReady.notify_one();
+  }
+}
+
+void HeightmapExport::writeLoop()
+{
+  for(;;)
+  {
+    WriteTask task;
+    ExportFile* f;
+    {
+      unique_lock<mutex> guard(lock);
+      writeReady.wait(guard, [&] { return !writeTasks.empty() || stopping; });
+      if(writeTasks.empty())
+        return;
+
+      task = writeTasks.front();
+      writeTasks.pop_front();
+      f = files[task.file];
+    }
+
+    //chunks of a file are usually written in order, in which case the seek is a no-op
+    f->stream.seekp(streamoff(task.offset));
+    f->stream.write((const char*)&buffers[task.buffer][0], streamsize(task.bytes));
+    bool ok = bool(f->stream);
+
+    ExportFile* done = NULL;
+    {
+      lock_guard<mutex> guard(lock);
+      freeBuffers.push_back(task.buffer);
+      f->ok = f->ok && ok;
+      f->pending--;
+      if(f->closed && f->pending == 0)
+        done = retire(task.file);
+    }
+    bufferFree.notify_one();
+    written.notify_all();
+
+    if(done != NULL)
+      complete(done);
+  }
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "imageio.h"
+
+//writes heightmaps in the background: rows are handed over as soon as they are final, encoded on worker threads
+//into a fixed set of reusable buffers and written by one I/O thread a buffer at a time, so the caller carries on
+//computing while its output goes to disk
+//the files come out byte for byte as writeHeightmap() writes them
+class HeightmapExport
+{
+public:
+  //encoding is much cheaper than the disk, so a couple of threads keep up with it
+  //at most buffers chunks of rows (each about bufferBytes) are held encoded at once; writeRows() never blocks,
+  //the encoders wait for a free buffer instead
+  HeightmapExport(int encodeThreads = 2, int buffers = 8, size_t bufferBytes = size_t(4) << 20);
+
+  //closes any file left open and waits for everything to be written
+  ~HeightmapExport();
+
+  //creates a file and writes its header, returning a handle for the calls below, or -1 if it cannot be created
+  int open(const std::string& name, int width, int height, HeightmapFormat format);
+
+  //queues count rows of the file starting at row y, in any order
+  //the rows are read later by the encoders, so they must stay unchanged until flush() or the file is done
+  void writeRows(int file, const float* rows, int y, int count);
+
+  //waits until every row queued so far for the file has been written, so their memory can be reused
+  void flush(int file);
+
+  //no more rows for the file: once the last has been written it is closed and done (if set) is called with whether
+  //every write succeeded, on the I/O thread, or on the caller's if nothing is left to write
+  //done must not call back into this export
+  void close(int file, const std::function<void(bool)>& done = std::function<void(bool)>());
+
+  //waits until every closed file is done, returning false if any of the files done since the last call failed
+  bool finish();
+
+private:
+  HeightmapExport(const HeightmapExport&);
+  HeightmapExport& operator=(const HeightmapExport&);
+
+  struct ExportFile
+  {
+    std::ofstream stream;
+    int width;
+    HeightmapFormat format;
+    size_t headerBytes;
+    size_t rowBytes;
+
+    //chunks queued and not yet written
+    int pending;
+    bool closed;
+    bool ok;
+    std::function<void(bool)> done;
+  };
+
+  struct EncodeTask
+  {
+    int file;
+    const float* rows;
+    int y;
+    int count;
+  };
+
+  struct WriteTask
+  {
+    int file;
+    size_t offset;
+    int buffer;
+    size_t bytes;
+  };
+
+  void encodeLoop();
+  void writeLoop();
+
+  //called with lock held on a closed file with nothing pending, returns the file for the caller to finish
+  //once it has released the lock
+  ExportFile* retire(int file);
+  void complete(ExportFile* f);
+
+  size_t bufferBytes;
+  std::vector<std::vector<unsigned char> > buffers;
+  std::vector<int> freeBuffers;
+
+  //files are never moved, and are deleted (leaving NULL) once done
+  std::vector<ExportFile*> files;
+  std::deque<EncodeTask> encodeTasks;
+  std::deque<WriteTask> writeTasks;
+
+  //files closed and not yet done, and files done with a failed write since the last finish()
+  int closing;
+  int failed;
+  bool stopping;
+
+  std::mutex lock;
+  std::condition_variable encodeReady;
+  std::condition_variable writeReady;
+  std::condition_variable bufferFree;
+  std::condition_variable written;
+
+  std::vector<std::thread> encoders;
+  std::thread writer;
+};
@@ -0,0 +1,95 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int threads)
+  : job(NULL), jobCount(0), nextTask(0), activeWorkers(0), generation(0), stopping(false)
+{
+  if(threads <= 0)
+    threads = defaultThreadCount();
+
+  for(int i = 1; i < threads; i++)
+    workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+
+  for(size_t i = 0; i < workers.size(); i++)
+    workers[i].join();
+}
+
+int ThreadPool::threadCount() const
+{
+  return int(workers.size()) + 1;
+}
+
+int ThreadPool::defaultThreadCount()
+{
+  int hardware = int(std::thread::hardware_concurrency());
+  return hardware > 0 ? hardware : 1;
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int)>& task)
+{
+  if(count <= 0)
+    return;
+
+  //nothing to share, skip the hand-off
+  if(workers.empty() || count == 1)
+  {
+    for(int i = 0; i < count; i++)
+      task(i);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    job = &task;
+    jobCount = count;
+    nextTask = 0;
+    activeWorkers = int(workers.size());
+    ++generation;
+  }
+  wake.notify_all();
+
+  runTasks();
+
+  //barrier: wait for every worker to leave this job
+  std::unique_lock<std::mutex> guard(lock);
+  finished.wait(guard, [this]{ return activeWorkers == 0; });
+  job = NULL;
+}
+
+void ThreadPool::runTasks()
+{
+  for(int i = nextTask++; i < jobCount; i = nextTask++)
+    (*job)(i);
+}
+
+void ThreadPool::workerLoop()
+{
+  unsigned seen = 0;
+
+  for(;;)
+  {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [&]{ return stopping || generation != seen; });
+      if(stopping)
+        return;
+      seen = generation;
+    }
+
+    runTasks();
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      --activeWorkers;
+    }
+    finished.notify_one();
+  }
+}
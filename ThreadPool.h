@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//persistent pool of worker threads
+//the thread calling parallelFor() takes part in the work, so a pool of N threads starts N - 1 workers
+class ThreadPool
+{
+public:
+  ThreadPool(int threads);
+  ~ThreadPool();
+
+  int threadCount() const;
+
+  //runs task(0) ... task(count - 1) across the pool and returns once every task has finished,
+  //so consecutive calls are separated by a barrier
+  //tasks must not call parallelFor() on the same pool
+  void parallelFor(int count, const std::function<void(int)>& task);
+
+  //number of threads to use when the caller asks for 0 (all hardware threads)
+  static int defaultThreadCount();
+
+private:
+  ThreadPool(const ThreadPool&);
+  ThreadPool& operator=(const ThreadPool&);
+
+  void workerLoop();
+  void runTasks();
+
+  std::vector<std::thread> workers;
+  std::mutex lock;
+  std::condition_variable wake;
+  std::condition_variable finished;
+
+  const std::function<void(int)>* job;
+  int jobCount;
+  std::atomic<int> nextTask;
+  int activeWorkers;
+  unsigned generation;
+  bool stopping;
+};
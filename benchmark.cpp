@@ -0,0 +1,445 @@
+//benchmark for the stages of the terrain pipeline: fractal generation, bicubic interpolation, erosion, splat maps and export
+//usage: benchmark [sizes=257,1025,4097,8193] [threads=1,<hardware threads>] [iterations=10] [json=benchmark.json] [trace=<prefix>]
+//with trace set, builds with EROSION_TRACE defined also write a Chrome trace and a CSV of every plain erosion run
+//every stage reports cells per second, bytes per second and its own peak resident set size
+//bytes are the output written (the splat map and normal map for splat), except for erosion where they are the simulation state swept once per iteration
+//(sparse erosion counts every cell, so its rates show the speedup from the tiles it skips)
+#include "fractal.h"
+#include "mathfuncs.h"
+#include "Erosion.h"
+#include "ErosionGrid.h"
+#include "imageio.h"
+#include "HeightmapExport.h"
+#include "png.h"
+#include "random.h"
+#include "ThreadPool.h"
+#ifdef EROSION_TRACE
+#include "ErosionTrace.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const uint64_t BENCHMARK_SEED = 1;
+
+//size of the coarse grid interpolated up to the terrain size
+const int INTERPOLATION_SOURCE = 24;
+
+//tile size of the sparse erosion stage
+const int SPARSE_TILE_SIZE = 64;
+
+enum ErosionMode
+{
+  EROSION_PLAIN,
+  EROSION_FUSED,
+  EROSION_SPARSE,
+  EROSION_HALF
+};
+
+struct BenchResult
+{
+  string stage;
+  int size;
+  int threads;
+  int iterations;
+  double seconds;
+  double cells;
+  double bytes;
+  long peakKb;
+  ErosionProfile profile;
+};
+
+vector<int> parseList(const string& text)
+{
+  vector<int> values;
+  stringstream stream(text);
+  string item;
+  while(getline(stream, item, ','))
+    values.push_back(atoi(item.c_str()));
+  return values;
+}
+
+//resets the peak resident set size so the next reading only covers what follows (Linux 4.0 and later)
+bool resetPeakRss()
+{
+  ofstream clearRefs("/proc/self/clear_refs");
+  clearRefs << "5";
+  return bool(clearRefs);
+}
+
+long peakRssKb()
+{
+  ifstream status("/proc/self/status");
+  string line;
+  while(getline(status, line))
+  {
+    if(line.compare(0, 6, "VmHWM:") == 0)
+      return atol(line.c_str() + 6);
+  }
+  return 0;
+}
+
+double elapsedSeconds(chrono::steady_clock::time_point start)
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+float* makeFractal(int size)
+{
+  int iterations = 0;
+  while((1 << iterations) + 1 < size)
+    iterations++;
+
+  float startFractal[4];
+  for(int i = 0; i < 4; i++)
+    startFractal[i] = randomRange(0.5, 0.7, randomUnit(BENCHMARK_SEED, RANDOM_START, 0, i, 0));
+
+  float* finished;
+  makeFractalArray(&startFractal[0], 2, finished, size, iterations, BENCHMARK_SEED);
+  return finished;
+}
+
+BenchResult benchFractal(int size)
+{
+  BenchResult result;
+  result.stage = "fractal";
+  result.size = size;
+  result.threads = 1;
+  result.iterations = 1;
+
+  resetPeakRss();
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  float* terrain = makeFractal(size);
+  result.seconds = elapsedSeconds(start);
+  result.peakKb = peakRssKb();
+  delete[] terrain;
+
+  result.cells = double(size) * size;
+  result.bytes = result.cells * sizeof(float);
+  return result;
+}
+
+BenchResult benchInterpolation(int size, int threads)
+{
+  BenchResult result;
+  result.stage = "interpolation";
+  result.size = size;
+  result.threads = threads;
+  result.iterations = 1;
+
+  vector<float> source(INTERPOLATION_SOURCE * INTERPOLATION_SOURCE);
+  for(size_t i = 0; i < source.size(); i++)
+    source[i] = randomUnit(BENCHMARK_SEED, RANDOM_START, 1, uint32_t(i), 0);
+
+  resetPeakRss();
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  float* smoothed = new float[size_t(size) * size];
+  bicubicInterpolate(&source[0], INTERPOLATION_SOURCE, smoothed, size, threads);
+  result.seconds = elapsedSeconds(start);
+  result.peakKb = peakRssKb();
+  delete[] smoothed;
+
+  result.cells = double(size) * size;
+  result.bytes = result.cells * sizeof(float);
+  return result;
+}
+
+BenchResult benchErosion(float* terrain, int size, int threads, int iterations, ErosionMode mode, const string& tracePrefix)
+{
+  const char* stages[] = {"erosion", "erosion (fused)", "erosion (sparse)", "erosion (half)"};
+
+  BenchResult result;
+  result.stage = stages[mode];
+  result.size = size;
+  result.threads = threads;
+  result.iterations = iterations;
+
+  ErosionSettings settings;
+  settings.threads = threads;
+  settings.fused = mode == EROSION_FUSED;
+  settings.sparseTileSize = mode == EROSION_SPARSE ? SPARSE_TILE_SIZE : 0;
+  settings.halfPrecision = mode == EROSION_HALF;
+  settings.iterations = iterations;
+  settings.profile = &result.profile;
+
+#ifdef EROSION_TRACE
+  ErosionTrace trace;
+  if(!tracePrefix.empty() && mode == EROSION_PLAIN)
+    settings.trace = &trace;
+#else
+  (void)tracePrefix;
+#endif
+
+  resetPeakRss();
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  float* water;
+  float* eroded = erodeField(terrain, water, size, BENCHMARK_SEED, settings);
+  result.seconds = elapsedSeconds(start);
+  result.peakKb = peakRssKb();
+  delete[] eroded;
+  delete[] water;
+
+  result.cells = double(size) * size * iterations;
+  result.bytes = result.cells * (mode == EROSION_HALF ? EROSION_GRID_HALF_BYTES_PER_CELL : EROSION_GRID_BYTES_PER_CELL);
+
+#ifdef EROSION_TRACE
+  if(settings.trace != NULL)
+  {
+    string name = tracePrefix + "-" + to_string(size) + "-" + to_string(threads);
+    trace.writeChromeTrace(name + ".json");
+    trace.writeCsv(name + ".csv");
+  }
+#endif
+  return result;
+}
+
+BenchResult benchSplat(float* terrain, int size, int threads)
+{
+  BenchResult result;
+  result.stage = "splat";
+  result.size = size;
+  result.threads = threads;
+  result.iterations = 1;
+
+  SplatSettings settings;
+  settings.threads = threads;
+  vector<unsigned char> normals(size_t(size) * size * 3);
+
+  resetPeakRss();
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  unsigned char* splat = genSplat(terrain, NULL, NULL, size, &normals[0], settings);
+  result.seconds = elapsedSeconds(start);
+  result.peakKb = peakRssKb();
+  delete[] splat;
+
+  result.cells = double(size) * size;
+  result.bytes = result.cells * 7;
+  return result;
+}
+
+BenchResult benchExport(float* terrain, int size)
+{
+  BenchResult result;
+  result.stage = "export (pgm)";
+  result.size = size;
+  result.threads = 1;
+  result.iterations = 1;
+
+  const char* name = "benchmark.pgm";
+  resetPeakRss();
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  writeHeightmap(name, terrain, size, HEIGHTMAP_PGM16);
+  result.seconds = elapsedSeconds(start);
+  result.peakKb = peakRssKb();
+
+  ifstream written(name, ios::binary | ios::ate);
+  result.bytes = double(written.tellg());
+  written.close();
+  remove(name);
+
+  result.cells = double(size) * size;
+  return result;
+}
+
+//the same file written by a HeightmapExport with threads encoders, timed until the last byte is written
+BenchResult benchExportAsync(float* terrain, int size, int threads)
+{
+  BenchResult result;
+  result.stage = "export (async)";
+  result.size = size;
+  result.threads = threads;
+  result.iterations = 1;
+
+  const char* name = "benchmark.pgm";
+  resetPeakRss();
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  {
+    HeightmapExport exporter(threads);
+    int file = exporter.open(name, size, size, HEIGHTMAP_PGM16);
+    exporter.writeRows(file, terrain, 0, size);
+    exporter.close(file);
+    exporter.finish();
+  }
+  result.seconds = elapsedSeconds(start);
+  result.peakKb = peakRssKb();
+
+  ifstream written(name, ios::binary | ios::ate);
+  result.bytes = double(written.tellg());
+  written.close();
+  remove(name);
+
+  result.cells = double(size) * size;
+  return result;
+}
+
+BenchResult benchPng(float* terrain, int size, int threads)
+{
+  BenchResult result;
+  result.stage = "export (png)";
+  result.size = size;
+  result.threads = threads;
+  result.iterations = 1;
+
+  const char* name = "benchmark.png";
+  resetPeakRss();
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  writePng(name, terrain, size, threads);
+  result.seconds = elapsedSeconds(start);
+  result.peakKb = peakRssKb();
+
+  ifstream written(name, ios::binary | ios::ate);
+  result.bytes = double(written.tellg());
+  written.close();
+  remove(name);
+
+  result.cells = double(size) * size;
+  return result;
+}
+
+void printRow(const BenchResult& r)
+{
+  printf("%-16s %6d %7d %6d %10.3f %12.2f %10.1f %9.1f\n", r.stage.c_str(), r.size, r.threads, r.iterations,
+    r.seconds, r.cells / r.seconds / 1e6, r.bytes / r.seconds / 1e6, r.peakKb / 1024.0);
+
+  if(r.profile.iterations == 0)
+    return;
+
+  printf("%-16s %6s %7s %6s %10.6f %12s %10s %9s  (slowest %.6f, %.0f%% of cells simulated)\n", "  per iteration", "", "", "",
+    r.profile.totalSeconds / r.profile.iterations, "", "", "", r.profile.slowestIteration, 100 * r.profile.cellUpdates / r.cells);
+  for(int step = 0; step < STEP_COUNT; step++)
+  {
+    if(r.profile.stepSeconds[step] > 0)
+      printf("  %-14s %6s %7s %6s %10.6f\n", erosionStepName(step), "", "", "", r.profile.stepSeconds[step] / r.profile.iterations);
+  }
+}
+
+void writeJson(const string& name, const vector<BenchResult>& results)
+{
+  ofstream json(name);
+  json << "[\n";
+  for(size_t i = 0; i < results.size(); i++)
+  {
+    const BenchResult& r = results[i];
+    json << "  {\"stage\": \"" << r.stage << "\", \"size\": " << r.size << ", \"threads\": " << r.threads
+         << ", \"iterations\": " << r.iterations << ", \"seconds\": " << r.seconds
+         << ", \"cells_per_second\": " << r.cells / r.seconds << ", \"bytes_per_second\": " << r.bytes / r.seconds
+         << ", \"peak_rss_kb\": " << r.peakKb;
+
+    if(r.profile.iterations > 0)
+    {
+      json << ", \"seconds_per_iteration\": " << r.profile.totalSeconds / r.profile.iterations
+           << ", \"slowest_iteration\": " << r.profile.slowestIteration << ", \"cell_updates\": " << r.profile.cellUpdates
+           << ", \"step_seconds\": {";
+      for(int step = 0; step < STEP_COUNT; step++)
+        json << (step > 0 ? ", " : "") << "\"" << erosionStepName(step) << "\": " << r.profile.stepSeconds[step];
+      json << "}";
+    }
+
+    json << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  json << "]\n";
+}
+
+int main(int argc, char** argv)
+{
+  vector<int> sizes = parseList("257,1025,4097,8193");
+  vector<int> threadCounts(1, 1);
+  if(ThreadPool::defaultThreadCount() > 1)
+    threadCounts.push_back(ThreadPool::defaultThreadCount());
+  int iterations = 10;
+  string jsonName = "benchmark.json";
+  string tracePrefix;
+
+  for(int i = 1; i < argc; i++)
+  {
+    string arg = argv[i];
+    size_t split = arg.find('=');
+    string key = arg.substr(0, split);
+    string value = split == string::npos ? "" : arg.substr(split + 1);
+
+    if(key == "sizes")
+      sizes = parseList(value);
+    else if(key == "threads")
+      threadCounts = parseList(value);
+    else if(key == "iterations")
+      iterations = atoi(value.c_str());
+    else if(key == "json")
+      jsonName = value;
+    else if(key == "trace")
+      tracePrefix = value;
+    else
+    {
+      cout << "usage: benchmark [sizes=257,1025,...] [threads=1,4,...] [iterations=10] [json=benchmark.json] [trace=<prefix>]" << endl;
+      return 1;
+    }
+  }
+
+#ifndef EROSION_TRACE
+  if(!tracePrefix.empty())
+    cout << "Built without EROSION_TRACE, no traces will be written" << endl;
+#endif
+
+  if(!resetPeakRss())
+    cout << "Cannot reset peak RSS, peaks cover the whole run so far" << endl;
+
+  vector<BenchResult> results;
+  printf("%-16s %6s %7s %6s %10s %12s %10s %9s\n", "stage", "size", "threads", "iters", "seconds", "Mcells/s", "MB/s", "peak MB");
+
+  for(size_t s = 0; s < sizes.size(); s++)
+  {
+    int size = sizes[s];
+
+    results.push_back(benchFractal(size));
+    printRow(results.back());
+
+    for(size_t t = 0; t < threadCounts.size(); t++)
+    {
+      results.push_back(benchInterpolation(size, threadCounts[t]));
+      printRow(results.back());
+    }
+
+    float* terrain = makeFractal(size);
+
+    for(size_t t = 0; t < threadCounts.size(); t++)
+    {
+      for(int mode = EROSION_PLAIN; mode <= EROSION_HALF; mode++)
+      {
+        results.push_back(benchErosion(terrain, size, threadCounts[t], iterations, ErosionMode(mode), tracePrefix));
+        printRow(results.back());
+      }
+    }
+
+    for(size_t t = 0; t < threadCounts.size(); t++)
+    {
+      results.push_back(benchSplat(terrain, size, threadCounts[t]));
+      printRow(results.back());
+    }
+
+    results.push_back(benchExport(terrain, size));
+    printRow(results.back());
+
+    for(size_t t = 0; t < threadCounts.size(); t++)
+    {
+      results.push_back(benchExportAsync(terrain, size, threadCounts[t]));
+      printRow(results.back());
+    }
+
+    for(size_t t = 0; t < threadCounts.size(); t++)
+    {
+      results.push_back(benchPng(terrain, size, threadCounts[t]));
+      printRow(results.back());
+    }
+
+    delete[] terrain;
+  }
+
+  writeJson(jsonName, results);
+  cout << "Results written to " << jsonName << endl;
+}
@@ -1,11 +1,15 @@
 #include <math.h>
+#include <algorithm>
 #include <stdlib.h>
-#include <time.h>
 #include <iostream>
 #include <vector>
 #include <fstream>
 #include <string>
 #include "mathfuncs.h"
+#include "fractal.h"
+#include "random.h"
+#include "Heightfield.h"
+#include "ThreadPool.h"
 
 using namespace std;
 
@@ -16,108 +20,264 @@ bool isValid(int x, int y, int size)
   return (x > -1 && x < size && y > -1 && y < size);
 }
 
-float randomRange(float start, float end)
+//maps a uniform value in [0, 1) (see randomUnit()) onto [start, end)
+float randomRange(float start, float end, float unit)
 {
   float range = end - start;
-  return start + ((float)rand() / (float)RAND_MAX) * range;
+  return start + unit * range;
 }
 
-void makeFractalArray(float* starting, int startSize, float* &finished, int finishSize, int iterations)
+//smallest value >= min that lies on offset + n * step
+int firstOnLattice(int min, int offset, int step)
 {
-  //seed random gen
-  srand(time(NULL));
+  if(min <= offset)
+    return offset;
+  return offset + (min - offset + step - 1) / step * step;
+}
 
-  float* currentArray = starting;
-  float harmonic = START_HARMONIC;
+//diamond step for one level: cells with both coordinates odd multiples of half, inside [xMin, xMax] x [yMin, yMax]
+//each takes the average of its four diagonal corners, stride = 2 * half apart
+void diamondStep(FractalWindow& w, int half, int level, float harmonic, uint64_t seed, int xMin, int xMax, int yMin, int yMax)
+{
+  int stride = half * 2;
 
-  for(int i = 0; i < iterations; i++)
+  for(int y = firstOnLattice(yMin, half, stride); y <= yMax; y += stride)
   {
-    int currentSize = int(pow(2, log2(startSize - 1) + i) + 1);
-    int newSize = currentSize + currentSize - 1;
+    const float* below = w.row(y - half);
+    const float* above = w.row(y + half);
+    float* row = w.row(y);
+
+    for(int x = firstOnLattice(xMin, half, stride); x <= xMax; x += stride)
+    {
+      int i = x - w.x0;
+      float average = (below[i - half] + below[i + half] + above[i - half] + above[i + half]) / 4;
+
+      row[i] = average + randomRange(-harmonic, harmonic, randomUnit(seed, RANDOM_FRACTAL, level, x / half, y / half));
+    }
+  }
+}
+
+//square step for one level: cells with exactly one coordinate an odd multiple of half, inside [xMin, xMax] x [yMin, yMax]
+//each averages its neighbours half away (left, right, below, above), only three of them along the terrain's edge
+void squareStep(FractalWindow& w, int half, int level, float harmonic, uint64_t seed, int xMin, int xMax, int yMin, int yMax)
+{
+  int stride = half * 2;
+  int last = w.size - 1;
 
-    float* newArray = (float*)malloc(newSize * newSize * sizeof(float));
+  for(int y = firstOnLattice(yMin, 0, half); y <= yMax; y += half)
+  {
+    float* row = w.row(y);
+    const float* below = y > 0 ? w.row(y - half) : NULL;
+    const float* above = y < last ? w.row(y + half) : NULL;
+    int levelY = y / half;
 
-    //diamond and copy step
-    for(int y = 0; y < newSize; y++)
+    if(levelY & 1)
     {
-      for(int x = 0; x < newSize; x++)
+      //x runs over even multiples of half, both rows around exist
+      int x = firstOnLattice(xMin, 0, stride);
+
+      if(x == 0)
       {
-        if(x & 1 && y & 1) //if x and y are both odd, diamond
-        {
-          int xDown = floor(x / 2);
-          int yDown = floor(y / 2);
-
-          float rands[4];
-          rands[0] = currentArray[coord(xDown, yDown, currentSize)];
-          rands[1] = currentArray[coord(xDown + 1, yDown, currentSize)];
-          rands[2] = currentArray[coord(xDown, yDown + 1, currentSize)];
-          rands[3] = currentArray[coord(xDown + 1, yDown + 1, currentSize)];
-
-          float average = (rands[0] + rands[1] + rands[2] + rands[3]) / 4;
-
-          newArray[coord(x, y, newSize)] = average + randomRange(-harmonic, harmonic);
-          //cout << randomRange(-harmonic, harmonic);
-
-          //cout << "Diamond: " << x << " " << y << endl;
-        }
-        else if(!(x & 1) && !(y & 1)) //if x and y are both even, copy
-        {
-          newArray[coord(x, y, newSize)] = currentArray[coord(x / 2, y / 2, currentSize)];
-          //cout << "Copy: " << x << " " << y << endl;
-        }
+        int i = -w.x0;
+        row[i] = (row[i + half] + below[i] + above[i]) / 3 + randomRange(-harmonic, harmonic, randomUnit(seed, RANDOM_FRACTAL, level, 0, levelY));
+        x += stride;
       }
-    }
 
-    //printArray(newArray, newSize);
+      for(; x <= xMax && x < last; x += stride)
+      {
+        int i = x - w.x0;
+        float summation = row[i - half] + row[i + half] + below[i] + above[i];
+        row[i] = (summation / 4) + randomRange(-harmonic, harmonic, randomUnit(seed, RANDOM_FRACTAL, level, x / half, levelY));
+      }
 
-    //square step
-    for(int y = 0; y < newSize; y++)
+      if(x == last && x <= xMax)
+      {
+        int i = x - w.x0;
+        row[i] = (row[i - half] + below[i] + above[i]) / 3 + randomRange(-harmonic, harmonic, randomUnit(seed, RANDOM_FRACTAL, level, x / half, levelY));
+      }
+    }
+    else if(below == NULL || above == NULL)
     {
-      for(int x = 0; x < newSize; x++)
+      //x runs over odd multiples of half, one of the rows around is off the terrain
+      const float* side = below == NULL ? above : below;
+
+      for(int x = firstOnLattice(xMin, half, stride); x <= xMax; x += stride)
       {
-        if(!(x & 1) != !(y & 1)) //x or y is odd
-        {
-
-          float summation = 0;
-          int amount = 0;
-
-          if(isValid(x - 1, y, newSize))
-          {
-            summation += newArray[coord(x - 1, y, newSize)];
-            ++amount;
-          }
-          if(isValid(x + 1, y, newSize))
-          {
-            summation += newArray[coord(x + 1, y, newSize)];
-            ++amount;
-          }
-          if(isValid(x, y - 1, newSize))
-          {
-            summation += newArray[coord(x, y - 1, newSize)];
-            ++amount;
-          }
-          if(isValid(x, y + 1, newSize))
-          {
-            summation += newArray[coord(x, y + 1, newSize)];
-            ++amount;
-          }
-
-          newArray[coord(x, y, newSize)] = (summation / amount) + randomRange(-harmonic, harmonic);
-
-          //cout << "Square: " << x << " " << y << endl;
-        }
+        int i = x - w.x0;
+        float summation = row[i - half] + row[i + half] + side[i];
+        row[i] = (summation / 3) + randomRange(-harmonic, harmonic, randomUnit(seed, RANDOM_FRACTAL, level, x / half, levelY));
       }
     }
+    else
+    {
+      for(int x = firstOnLattice(xMin, half, stride); x <= xMax; x += stride)
+      {
+        int i = x - w.x0;
+        float summation = row[i - half] + row[i + half] + below[i] + above[i];
+        row[i] = (summation / 4) + randomRange(-harmonic, harmonic, randomUnit(seed, RANDOM_FRACTAL, level, x / half, levelY));
+      }
+    }
+  }
+}
+
+//every displacement is drawn from (seed, iteration, x, y), so the same seed always gives the same terrain
+//works in place in one finishSize * finishSize grid (finishSize = (startSize - 1) * 2^iterations + 1):
+//the starting values are spread out to the coarsest lattice, and each iteration fills in the cells halfway
+//between those of the last one, only visiting the cells it writes
+//FractalTiler generates the same terrain tile by tile
+void makeFractalArray(float* starting, int startSize, float* &finished, int finishSize, int iterations, uint64_t seed)
+{
+  int stride = 1 << iterations;
+  int size = (startSize - 1) * stride + 1;
+  float* grid = new float[size_t(size) * size];
+
+  for(int y = 0; y < startSize; y++)
+  {
+    for(int x = 0; x < startSize; x++)
+    {
+      grid[coord(x * stride, y * stride, size)] = starting[coord(x, y, startSize)];
+    }
+  }
+
+  FractalWindow whole;
+  whole.data = grid;
+  whole.x0 = 0;
+  whole.y0 = 0;
+  whole.width = size;
+  whole.size = size;
+
+  float harmonic = START_HARMONIC;
+
+  for(int i = 0; i < iterations; i++)
+  {
+    int half = stride / 2;
+
+    diamondStep(whole, half, i, harmonic, seed, 0, size - 1, 0, size - 1);
+    squareStep(whole, half, i, harmonic, seed, 0, size - 1, 0, size - 1);
+
+    stride = half;
+    harmonic *= 0.5;
+  }
+
+  finished = grid;
+}
+
+FractalTiler::FractalTiler(float* starting, int startSize, int iterations, int tileSize, uint64_t seed)
+  : iterations(iterations), tileSize(tileSize), seed(seed)
+{
+  //levels coarser than a tile are cheap, so they are generated once for the whole terrain
+  //a tile is at most the 2^iterations cells one starting cell grows into, so small terrains are one tile per cell
+  tileLevels = std::min(int(log2(tileSize)), iterations);
+  this->tileSize = 1 << tileLevels;
+  coarseIterations = iterations - tileLevels;
+  coarseSize = (startSize - 1) * (1 << coarseIterations) + 1;
+  terrainSize = (coarseSize - 1) * this->tileSize + 1;
+  makeFractalArray(starting, startSize, coarse, coarseSize, coarseIterations, seed);
+}
+
+FractalTiler::~FractalTiler()
+{
+  delete[] coarse;
+}
+
+int FractalTiler::size() const
+{
+  return terrainSize;
+}
+
+int FractalTiler::tilesPerSide() const
+{
+  return coarseSize - 1;
+}
 
-    //printArray(newArray, newSize);
+int FractalTiler::getTileSize() const
+{
+  return tileSize;
+}
+
+//a cell at the finest level depends on cells up to two tiles away through the square steps of coarser levels,
+//so the tile is generated inside a window reaching two coarse cells past it on every side
+//at each level only the cells the finer levels will read are computed: square cells within 2 * half - 2
+//of the tile and diamond cells within 3 * half - 2
+void FractalTiler::generateTile(int tx, int ty, float* tile) const
+{
+  generateTile(tx, ty, tile, tileSize + 1, tileSize + 1, tileSize + 1);
+}
+
+void FractalTiler::generateTile(int tx, int ty, float* dst, ptrdiff_t dstStride, int width, int height) const
+{
+  int last = terrainSize - 1;
+  int tileX = tx * tileSize;
+  int tileY = ty * tileSize;
 
-    if(currentArray != starting)
+  FractalWindow w;
+  w.x0 = std::max(0, tileX - 2 * tileSize);
+  w.y0 = std::max(0, tileY - 2 * tileSize);
+  int x1 = std::min(last, tileX + 3 * tileSize);
+  int y1 = std::min(last, tileY + 3 * tileSize);
+  w.width = x1 - w.x0 + 1;
+  w.size = terrainSize;
+
+  std::vector<float> window(size_t(w.width) * (y1 - w.y0 + 1));
+  w.data = &window[0];
+
+  for(int y = w.y0; y <= y1; y += tileSize)
+  {
+    for(int x = w.x0; x <= x1; x += tileSize)
     {
-      delete[] currentArray;
+      w.row(y)[x - w.x0] = coarse[coord(x / tileSize, y / tileSize, coarseSize)];
     }
-    currentArray = newArray;
+  }
+
+  float harmonic = START_HARMONIC;
+  for(int i = 0; i < coarseIterations; i++)
+    harmonic *= 0.5;
+
+  int stride = tileSize;
+  for(int i = coarseIterations; i < iterations; i++)
+  {
+    int half = stride / 2;
+    int diamondMargin = 3 * half - 2;
+    int squareMargin = 2 * half - 2;
+
+    diamondStep(w, half, i, harmonic, seed,
+      std::max(w.x0, tileX - diamondMargin), std::min(x1, tileX + tileSize + diamondMargin),
+      std::max(w.y0, tileY - diamondMargin), std::min(y1, tileY + tileSize + diamondMargin));
+    squareStep(w, half, i, harmonic, seed,
+      std::max(w.x0, tileX - squareMargin), std::min(x1, tileX + tileSize + squareMargin),
+      std::max(w.y0, tileY - squareMargin), std::min(y1, tileY + tileSize + squareMargin));
+
+    stride = half;
     harmonic *= 0.5;
   }
 
-  finished = currentArray;
+  for(int y = 0; y < height; y++)
+  {
+    const float* src = w.row(tileY + y) + (tileX - w.x0);
+    std::copy(src, src + width, dst + y * dstStride);
+  }
+}
+
+//every container tile is generated straight into the mapping, container tiles do not share edges
+//so the last row and column of the terrain come from an extra row and column of one cell wide tiles
+bool generateFractalHeightfield(const FractalTiler& tiler, Heightfield& field, int channel, int threads)
+{
+  int tileSize = tiler.getTileSize();
+  if(field.size() != tiler.size() || field.getTileSize() != tileSize || channel >= field.channelCount())
+    return false;
+
+  int tiles = tiler.tilesPerSide() + 1;
+  ThreadPool pool(threads);
+
+  pool.parallelFor(tiles * tiles, [&](int i)
+  {
+    int tx = i % tiles;
+    int ty = i / tiles;
+    int width = std::min(tileSize, tiler.size() - tx * tileSize);
+    int height = std::min(tileSize, tiler.size() - ty * tileSize);
+
+    tiler.generateTile(tx, ty, field.tile(channel, 0, tx, ty), tileSize, width, height);
+  });
+
+  return true;
 }
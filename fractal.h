@@ -1,8 +1,68 @@
 #ifndef FRACTAL_H
 #define FRACTAL_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 bool isValid(int x, int y, int size);
-float randomRange(float start, float end);
-void makeFractalArray(float* starting, int startSize, float* &finished, int finishSize, int iterations);
+float randomRange(float start, float end, float unit);
+void makeFractalArray(float* starting, int startSize, float* &finished, int finishSize, int iterations, uint64_t seed);
+
+//rectangle of a terrain held in memory, rows are width floats apart
+struct FractalWindow
+{
+  float* row(int y) { return data + size_t(y - y0) * width; }
+
+  float* data;
+  int x0;
+  int y0;
+  int width;
+  int size; //of the whole terrain
+};
+
+//generates a diamond-square terrain one tile at a time, for terrains too big to hold in memory
+//tiles are tileSize + 1 cells wide (tileSize a power of two) and share their edge cells with their neighbours
+//a tile comes out exactly as the same cells of makeFractalArray() would for the same seed, whichever
+//other tiles are generated and in whatever order, so tiles can be generated in parallel
+//a tileSize bigger than the 2^iterations cells each starting cell grows into is clamped to it, see getTileSize()
+class FractalTiler
+{
+public:
+  FractalTiler(float* starting, int startSize, int iterations, int tileSize, uint64_t seed);
+  ~FractalTiler();
+
+  int size() const;
+  int tilesPerSide() const;
+  int getTileSize() const;
+
+  //writes the (tileSize + 1)^2 cells of tile (tx, ty) row-major into tile, safe to call from several threads
+  void generateTile(int tx, int ty, float* tile) const;
+
+  //writes the first width * height of them (at most tileSize + 1 each way), rows dstStride floats apart
+  //tx and ty may be tilesPerSide(), for the tiles holding just the last column or row of the terrain
+  void generateTile(int tx, int ty, float* dst, ptrdiff_t dstStride, int width, int height) const;
+
+private:
+  FractalTiler(const FractalTiler&);
+  FractalTiler& operator=(const FractalTiler&);
+
+  int iterations;
+  int tileSize;
+  int tileLevels;
+  uint64_t seed;
+
+  //the levels coarser than a tile, one cell per tile corner
+  float* coarse;
+  int coarseSize;
+  int coarseIterations;
+
+  int terrainSize;
+};
+
+class Heightfield;
+
+//fills level 0 of a heightfield channel with the tiler's terrain, generating tiles in parallel
+//the heightfield must be tiler.size() cells across and use the same tile size
+bool generateFractalHeightfield(const FractalTiler& tiler, Heightfield& field, int channel, int threads);
 
 #endif
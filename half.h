@@ -0,0 +1,77 @@
+#ifndef HALF_H
+#define HALF_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+//IEEE 754 half precision floats, kept as their 16 bits
+//conversions round to nearest even and keep infinities, the same as the F16C instructions,
+//which are used instead where the compiler targets them
+
+inline uint16_t floatToHalf(float value)
+{
+#if defined(__F16C__)
+  return uint16_t(_cvtss_sh(value, 0));
+#else
+  uint32_t bits;
+  memcpy(&bits, &value, 4);
+  uint32_t sign = (bits >> 16) & 0x8000;
+  bits &= 0x7FFFFFFF;
+
+  //too large for a half: infinity, or a quiet NaN
+  if(bits >= 0x47800000)
+    return uint16_t(sign | (bits > 0x7F800000 ? 0x7E00 : 0x7C00));
+
+  //below 2^-14 the half is subnormal: adding 0.5 lines its 10 mantissa bits up with the bottom of
+  //the float's, and the float addition does the rounding
+  if(bits < 0x38800000)
+  {
+    float shifted;
+    memcpy(&shifted, &bits, 4);
+    shifted += 0.5f;
+    memcpy(&bits, &shifted, 4);
+    return uint16_t(sign | (bits - 0x3F000000));
+  }
+
+  //rebias the exponent and round the 13 dropped bits to nearest even
+  bits += 0xC8000FFF + ((bits >> 13) & 1);
+  return uint16_t(sign | (bits >> 13));
+#endif
+}
+
+inline float halfToFloat(uint16_t half)
+{
+#if defined(__F16C__)
+  return _cvtsh_ss(half);
+#else
+  uint32_t bits = uint32_t(half & 0x7FFF) << 13;
+  uint32_t exponent = bits & 0x0F800000;
+  bits += 0x38000000;
+
+  if(exponent == 0x0F800000)
+  {
+    //infinity or NaN
+    bits += 0x38000000;
+  }
+  else if(exponent == 0)
+  {
+    //zero or subnormal, renormalised by a float subtraction
+    bits += 0x00800000;
+    float value;
+    memcpy(&value, &bits, 4);
+    value -= 6.103515625e-05f;
+    memcpy(&bits, &value, 4);
+  }
+
+  bits |= uint32_t(half & 0x8000) << 16;
+  float value;
+  memcpy(&value, &bits, 4);
+  return value;
+#endif
+}
+
+#endif
@@ -0,0 +1,130 @@
+#include <cstring>
+#include "imageio.h"
+
+using namespace std;
+
+bool parseHeightmapFormat(const string& name, HeightmapFormat& format)
+{
+  if(name == "pgm")
+    format = HEIGHTMAP_PGM16;
+  else if(name == "float")
+    format = HEIGHTMAP_FLOAT32;
+  else if(name == "u16")
+    format = HEIGHTMAP_UINT16;
+  else
+    return false;
+  return true;
+}
+
+uint16_t toSample(float height)
+{
+  float scaled = height * 65535;
+  if(!(scaled > 0))
+    return 0;
+  if(scaled > 65535)
+    return 65535;
+  return uint16_t(scaled);
+}
+
+string heightmapHeader(int width, int height, HeightmapFormat format)
+{
+  if(format != HEIGHTMAP_PGM16)
+    return string();
+  return "P5\n" + to_string(width) + " " + to_string(height) + "\n65535\n";
+}
+
+size_t heightmapSampleBytes(HeightmapFormat format)
+{
+  return format == HEIGHTMAP_FLOAT32 ? 4 : 2;
+}
+
+//byte order is spelled out so files come out the same on any host
+void encodeHeightmapRow(const float* row, int width, HeightmapFormat format, unsigned char* out)
+{
+  switch(format)
+  {
+  case HEIGHTMAP_PGM16:
+    for(int x = 0; x < width; x++)
+    {
+      uint16_t sample = toSample(row[x]);
+      out[2 * x] = (unsigned char)(sample >> 8);
+      out[2 * x + 1] = (unsigned char)sample;
+    }
+    break;
+  case HEIGHTMAP_UINT16:
+    for(int x = 0; x < width; x++)
+    {
+      uint16_t sample = toSample(row[x]);
+      out[2 * x] = (unsigned char)sample;
+      out[2 * x + 1] = (unsigned char)(sample >> 8);
+    }
+    break;
+  case HEIGHTMAP_FLOAT32:
+    for(int x = 0; x < width; x++)
+    {
+      uint32_t bits;
+      memcpy(&bits, &row[x], 4);
+      out[4 * x] = (unsigned char)bits;
+      out[4 * x + 1] = (unsigned char)(bits >> 8);
+      out[4 * x + 2] = (unsigned char)(bits >> 16);
+      out[4 * x + 3] = (unsigned char)(bits >> 24);
+    }
+    break;
+  }
+}
+
+HeightmapWriter::HeightmapWriter(const string& name, int width, int height, HeightmapFormat format)
+  : width(width), format(format)
+{
+  rowBuffer.resize(size_t(width) * heightmapSampleBytes(format));
+
+  file.open(name, ios::binary);
+  file << heightmapHeader(width, height, format);
+}
+
+bool HeightmapWriter::isOpen() const
+{
+  return file.is_open() && file.good();
+}
+
+void HeightmapWriter::writeRows(const float* rows, int count)
+{
+  for(int y = 0; y < count; y++)
+  {
+    encodeHeightmapRow(rows + size_t(y) * width, width, format, &rowBuffer[0]);
+    file.write((const char*)&rowBuffer[0], streamsize(rowBuffer.size()));
+  }
+}
+
+void HeightmapWriter::close()
+{
+  file.close();
+}
+
+bool writeHeightmap(const string& name, const float* data, int size, HeightmapFormat format)
+{
+  HeightmapWriter writer(name, size, size, format);
+  if(!writer.isOpen())
+    return false;
+
+  writer.writeRows(data, size);
+  bool ok = writer.isOpen();
+  writer.close();
+  return ok;
+}
+
+bool writePixmap(const string& name, const unsigned char* pixels, int width, int height, int channels)
+{
+  if(channels != 1 && channels != 3 && channels != 4)
+    return false;
+
+  ofstream file(name, ios::binary);
+  if(channels == 4)
+    file << "P7\nWIDTH " << width << "\nHEIGHT " << height << "\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+  else
+    file << (channels == 1 ? "P5\n" : "P6\n") << width << " " << height << "\n255\n";
+
+  file.write((const char*)pixels, streamsize(size_t(width) * height * channels));
+  file.close();
+  return bool(file);
+}
@@ -0,0 +1,59 @@
+#ifndef IMAGEIO_H
+#define IMAGEIO_H
+
+#include <stdint.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+//binary heightmap formats, heights are expected in [0, 1] for the 16 bit ones
+enum HeightmapFormat
+{
+  HEIGHTMAP_PGM16,   //P5 greyscale, 16 bit big-endian samples
+  HEIGHTMAP_FLOAT32, //headerless row-major floats, little-endian
+  HEIGHTMAP_UINT16   //headerless row-major 16 bit samples, little-endian
+};
+
+//parses "pgm", "float" or "u16", returning false for anything else
+bool parseHeightmapFormat(const std::string& name, HeightmapFormat& format);
+
+//maps [0, 1] onto the full 16 bit range, clamping anything outside
+uint16_t toSample(float height);
+
+//header written before the rows, empty for the headerless formats
+std::string heightmapHeader(int width, int height, HeightmapFormat format);
+
+size_t heightmapSampleBytes(HeightmapFormat format);
+
+//encodes one row of width heights into width * heightmapSampleBytes() bytes
+void encodeHeightmapRow(const float* row, int width, HeightmapFormat format, unsigned char* out);
+
+//writes a heightmap a few rows at a time through one preallocated row buffer,
+//so terrains can be streamed out without ever being held whole
+class HeightmapWriter
+{
+public:
+  HeightmapWriter(const std::string& name, int width, int height, HeightmapFormat format);
+
+  bool isOpen() const;
+
+  //appends count rows of width heights
+  void writeRows(const float* rows, int count);
+
+  void close();
+
+private:
+  std::ofstream file;
+  int width;
+  HeightmapFormat format;
+  std::vector<unsigned char> rowBuffer;
+};
+
+//writes a whole size * size row-major heightmap
+bool writeHeightmap(const std::string& name, const float* data, int size, HeightmapFormat format);
+
+//writes a width * height row-major image of 1, 3 or 4 bytes per pixel as binary netpbm:
+//P5 (greyscale), P6 (RGB) or P7 (PAM, RGB_ALPHA)
+bool writePixmap(const std::string& name, const unsigned char* pixels, int width, int height, int channels);
+
+#endif
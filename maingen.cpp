@@ -1,7 +1,15 @@
 #include "fractal.h"
 #include "mathfuncs.h"
 #include "Erosion.h"
+#include "random.h"
+#include "ThreadPool.h"
+#include "imageio.h"
+#include "Heightfield.h"
+#include "Batch.h"
+#include "HeightmapExport.h"
+#include "png.h"
 #include <math.h>
+#include <algorithm>
 #include <stdlib.h>
 #include <time.h>
 #include <iostream>
@@ -11,80 +19,184 @@
 
 using namespace std;
 
-void writeImage(string name, float* data, int size)
+void writeImage(string name, float* data, int size, HeightmapFormat format)
 {
-  ofstream image;
-  image.open(name);
-  //write header
-  image << "P3\n";
-  image << size << " " << size << "\n";
-  image << "255\n";
-
-  for(int i = 0; i < size; i++)
+  if(!writeHeightmap(name, data, size, format))
+    cout << "Could not write " << name << endl;
+}
+
+//writes a terrain into a new heightfield file (height, water and sediment channels) and builds its mip levels
+void writeHeightfield(string name, float* data, int size, int tileSize)
+{
+  Heightfield field;
+  if(!field.create(name, size, tileSize, 3))
   {
-    for(int j = 0; j < size; j++)
-    {
-      unsigned short color = data[coord(i, j, size)] * 65535;
-      if(color < 0)
-        color = 0;
-      if(color > 65535)
-        color = 65535;
+    cout << "Could not write " << name << endl;
+    return;
+  }
 
-      unsigned char msb = color & 0xFF;
-      unsigned char lsb = (color >> 8) & 0xFF;
+  field.writeRegion(CHANNEL_HEIGHT, 0, 0, 0, size, size, data, size);
+  field.buildMips(CHANNEL_HEIGHT, 0);
+}
 
-      image << to_string(lsb) + " " + to_string(msb) + " " + to_string(0) + "  ";
-    }
-    image << "\n";
-  }
+//generates row ty of tiles into band, tileSize + 1 rows of heights
+void generateBand(const FractalTiler& tiler, ThreadPool& pool, int ty, float* band)
+{
+  int size = tiler.size();
+  int tileSize = tiler.getTileSize();
+  int tiles = tiler.tilesPerSide();
+
+  pool.parallelFor(tiles, [&](int tx)
+  {
+    vector<float> tile(size_t(tileSize + 1) * (tileSize + 1));
+    tiler.generateTile(tx, ty, &tile[0]);
 
-  image.close();
+    //neighbouring tiles share their edge column, only the last tile writes its right one
+    int width = tx == tiles - 1 ? tileSize + 1 : tileSize;
+    for(int y = 0; y <= tileSize; y++)
+      copy(&tile[y * (tileSize + 1)], &tile[y * (tileSize + 1)] + width, &band[size_t(y) * size + tx * tileSize]);
+  });
 }
 
-void writeSplat()
+//generates a terrain too big for memory tile by tile and streams it to disk, holding two rows of tiles at a time:
+//one being generated while the other is written out
+void writeTiledTerrain(string name, const FractalTiler& tiler, int threads, HeightmapFormat format)
 {
-  ofstream image;
-  image.open(name);
-  //write header
-  image << "P3\n";
-  image << size << " " << size << "\n";
-  image << "255\n";
-
-  for(int i = 0; i < size; i++)
+  int size = tiler.size();
+  int tileSize = tiler.getTileSize();
+  int tiles = tiler.tilesPerSide();
+  vector<float> bands[2];
+  bands[0].resize(size_t(tileSize + 1) * size);
+  bands[1].resize(size_t(tileSize + 1) * size);
+  ThreadPool pool(threads);
+
+  HeightmapExport exporter;
+  int file = exporter.open(name, size, size, format);
+  if(file < 0)
   {
-    for(int j = 0; j < size; j++)
-    {
-      unsigned short color = data[coord(i, j, size)] * 65535;
-      if(color < 0)
-        color = 0;
-      if(color > 65535)
-        color = 65535;
+    cout << "Could not write " << name << endl;
+    return;
+  }
 
-      unsigned char msb = color & 0xFF;
-      unsigned char lsb = (color >> 8) & 0xFF;
+  for(int ty = 0; ty < tiles; ty++)
+  {
+    vector<float>& band = bands[ty % 2];
+    generateBand(tiler, pool, ty, &band[0]);
 
-      image << to_string(lsb) + " " + to_string(msb) + " " + to_string(0) + "  ";
-    }
-    image << "\n";
+    //the band before this one must be written before it is generated over
+    exporter.flush(file);
+
+    //likewise the bottom row of a band is the top row of the next one
+    int rows = ty == tiles - 1 ? tileSize + 1 : tileSize;
+    exporter.writeRows(file, &band[0], ty * tileSize, rows);
+  }
+
+  exporter.close(file);
+  if(!exporter.finish())
+    cout << "Could not write " << name << endl;
+}
+
+//the same as a 16 bit greyscale PNG, compressed a band at a time
+void writeTiledPng(string name, const FractalTiler& tiler, int threads)
+{
+  int size = tiler.size();
+  int tileSize = tiler.getTileSize();
+  int tiles = tiler.tilesPerSide();
+  vector<float> band(size_t(tileSize + 1) * size);
+  ThreadPool pool(threads);
+
+  PngWriter file(name, size, size, 1, 16, threads);
+
+  for(int ty = 0; ty < tiles; ty++)
+  {
+    generateBand(tiler, pool, ty, &band[0]);
+    file.writeRows(&band[0], ty == tiles - 1 ? tileSize + 1 : tileSize);
   }
 
-  image.close();
+  if(!file.close())
+    cout << "Could not write " << name << endl;
 }
 
-int main()
+//writes the splat map of a terrain to <name>-splat.pam and its normal map to <name>-normal.ppm,
+//or to <name>-splat.png and <name>-normal.png with png set
+//water and sediment may be NULL
+void writeSplat(string name, float* data, float* water, float* sediment, int size, bool png)
 {
-  const int SIZE = 8193;
+  vector<unsigned char> normals(size_t(size) * size * 3);
+  unsigned char* splat = genSplat(data, water, sediment, size, &normals[0]);
+
+  string splatName = name + (png ? "-splat.png" : "-splat.pam");
+  string normalName = name + (png ? "-normal.png" : "-normal.ppm");
+  if(!(png ? writePng(splatName, splat, size, size, 4) : writePixmap(splatName, splat, size, size, 4)))
+    cout << "Could not write " << splatName << endl;
+  if(!(png ? writePng(normalName, &normals[0], size, size, 3) : writePixmap(normalName, &normals[0], size, size, 3)))
+    cout << "Could not write " << normalName << endl;
+
+  delete[] splat;
+}
+
+int main(int argc, char** argv)
+{
+  //largest terrain generated in memory, anything bigger is tiled and streamed to disk
+  const int IN_MEMORY_SIZE = 8193;
+  const int TILE_SIZE = 512;
+
+  //batch mode: maingen batch <file> [threads] [erosion runs] [memory budget in MB], see readBatchFile()
+  if(argc > 2 && string(argv[1]) == "batch")
+  {
+    vector<BatchJob> jobs;
+    if(!readBatchFile(argv[2], jobs))
+      return 1;
+
+    BatchSettings settings;
+    if(argc > 3)
+      settings.threads = atoi(argv[3]);
+    if(argc > 4)
+      settings.erosionRuns = atoi(argv[4]);
+    if(argc > 5)
+      settings.memoryBudget = size_t(atoi(argv[5])) << 20;
+
+    BatchResult result = runBatch(jobs, settings);
+    cout << result.finished << " terrains written, " << result.failed << " failed in " << result.seconds << "s ("
+      << (result.seconds > 0 ? result.finished * 3600 / result.seconds : 0) << " terrains per hour)" << endl;
+    return result.failed > 0 ? 1 : 0;
+  }
+
+  //the whole terrain is reproducible from this seed
+  uint64_t seed = argc > 1 ? strtoull(argv[1], NULL, 10) : uint64_t(time(NULL));
+  cout << "Seed: " << seed << endl;
+
+  //size must be a power of two plus one
+  int SIZE = argc > 2 ? atoi(argv[2]) : 8193;
+  int iterations = 0;
+  while((1 << iterations) + 1 < SIZE)
+    iterations++;
+  if(SIZE < 3 || (1 << iterations) + 1 != SIZE)
+  {
+    cout << "Size must be a power of two plus one" << endl;
+    return 1;
+  }
+
+  //pgm, float, u16, png (16 bit greyscale) or hf (tiled heightfield file)
+  HeightmapFormat format = HEIGHTMAP_PGM16;
+  string extension = "pgm";
+  if(argc > 3)
+  {
+    extension = argv[3];
+    if(extension != "hf" && extension != "png" && !parseHeightmapFormat(extension, format))
+    {
+      cout << "Format must be pgm, float, u16, png or hf" << endl;
+      return 1;
+    }
+  }
 
 /*
 
   float* startPerlin = new float[6 * 6];
 
-  //seed random gen
-  srand(time(NULL));
-
   for(int i = 0; i < 6 * 6; i++)
   {
-    startPerlin[i] = randomRange(0.0, 1.0);
+    startPerlin[i] = randomRange(0.0, 1.0, randomUnit(seed, RANDOM_START, 1, i, 0));
   }
   float* finishedPerlin = new float[SIZE * SIZE];
   bicubicInterpolate(&startPerlin[0], 6, &finishedPerlin[0], SIZE);
@@ -93,7 +205,7 @@ int main()
 
   for(int i = 0; i < 24 * 24; i++)
   {
-    startPerlin[i] = randomRange(-0.15, 0.15);
+    startPerlin[i] = randomRange(-0.15, 0.15, randomUnit(seed, RANDOM_START, 2, i, 0));
   }
   float* finishedPerlinSmall = new float[SIZE * SIZE];
   bicubicInterpolate(&startPerlinSmall[0], 24, &finishedPerlinSmall[0], SIZE);
@@ -116,15 +228,58 @@ int main()
 
   for(int i = 0; i < 2 * 2; i++)
   {
-    startFractal[i] = randomRange(0.5, 0.7);
+    startFractal[i] = randomRange(0.5, 0.7, randomUnit(seed, RANDOM_START, 0, i, 0));
+  }
+
+  if(SIZE > IN_MEMORY_SIZE)
+  {
+    FractalTiler tiler(&startFractal[0], 2, iterations, TILE_SIZE, seed);
+
+    if(extension == "hf")
+    {
+      Heightfield field;
+      if(!field.create("bigfinal.hf", SIZE, TILE_SIZE, 3))
+      {
+        cout << "Could not write bigfinal.hf" << endl;
+        return 1;
+      }
+      generateFractalHeightfield(tiler, field, CHANNEL_HEIGHT, 0);
+      field.buildMips(CHANNEL_HEIGHT, 0);
+    }
+    else if(extension == "png")
+      writeTiledPng("bigfinal.png", tiler, 0);
+    else
+      writeTiledTerrain("bigfinal." + extension, tiler, 0, format);
+    return 0;
   }
 
   float temp = 0;
   float* finishedFractal = &temp;
 
-  makeFractalArray(&startFractal[0], 2, finishedFractal, SIZE, 13);
+  makeFractalArray(&startFractal[0], 2, finishedFractal, SIZE, iterations, seed);
+
+  //writeImage("preerode." + extension, &finishedFractal[0], SIZE, format);
+
+  //the heightmap is written in the background while the splat map is worked out
+  HeightmapExport exporter;
+  bool written = true;
+  if(extension == "hf")
+    writeHeightfield("bigfinal.hf", &finishedFractal[0], SIZE, TILE_SIZE);
+  else if(extension == "png")
+    written = writePng("bigfinal.png", &finishedFractal[0], SIZE);
+  else
+  {
+    int file = exporter.open("bigfinal." + extension, SIZE, SIZE, format);
+    written = file >= 0;
+    if(written)
+    {
+      exporter.writeRows(file, &finishedFractal[0], 0, SIZE);
+      exporter.close(file);
+    }
+  }
 
-  //writeImage("preerode.ppm", &finishedFractal[0], SIZE);
+  writeSplat("bigfinal", &finishedFractal[0], NULL, NULL, SIZE, extension == "png");
 
-  writeImage("bigfinal.ppm", &finishedFractal[0], SIZE);
+  if(!exporter.finish() || !written)
+    cout << "Could not write bigfinal." << extension << endl;
 }
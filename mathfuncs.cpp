@@ -1,5 +1,11 @@
 #include <iostream>
 #include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include "mathfuncs.h"
+#include "ThreadPool.h"
+#include "simd.h"
 
 //helper function
 int coord(int x, int y, int size)
@@ -7,62 +13,143 @@ int coord(int x, int y, int size)
   return x + (y * size);
 }
 
-float* genSplat(float* map, int size)
+//0 at start rising linearly to 1 at end, and flat either side
+template<class Ops>
+typename Ops::V ramp(typename Ops::V value, float start, float end)
 {
-  //horizontal side
-  float hHeightDelta = 0.0;
-  int index = 0;
-  bool l;
-  Crd lSide = getCoordAtDir(Crd(x, y), LEFT, size, l);
-  if(!l)
-  {
-    hHeightDelta += sim[x][y].b - sim[lSide.x][lSide.y].b;
-    ++index;
-  }
+  typename Ops::V scaled = Ops::mul(Ops::sub(value, Ops::set(start)), Ops::set(1 / std::max(end - start, 1e-30f)));
+  return Ops::vmax(Ops::set(0.0f), Ops::vmin(scaled, Ops::set(1.0f)));
+}
 
-  bool r;
-  Crd rSide = getCoordAtDir(Crd(x, y), RIGHT, size, r);
-  if(!r)
-  {
-    hHeightDelta += sim[rSide.x][rSide.y].b - sim[x][y].b;
-    ++index;
-  }
+//[0, 1] onto a byte, rounded
+inline int toByte(float value)
+{
+  return int(value * 255 + 0.5f);
+}
+
+//heights of a row and the rows either side of it, which are the row itself on the edges of the map
+struct SplatRows
+{
+  const float* up;
+  const float* row;
+  const float* down;
+  const float* water;
+  const float* sediment;
+  float vScale;
+  unsigned char* splat;
+  unsigned char* normals;
+};
 
-  //adjust for boundary condition
-  if(index != 2)
-    hHeightDelta *= 2;
+//genSplat() on cells [x0, x1) of a row, with left and right the heights of the cells either side
+//the height differences are worked out as in heightDelta() of Step 5, with hScale and SplatRows::vScale
+//doubling them on the edges
+template<class Ops>
+void splatSpan(const SplatRows& r, const float* left, const float* right, float hScale, int x0, int x1, const SplatSettings& s)
+{
+  typedef typename Ops::V V;
+  const V zero = Ops::set(0.0f);
+  const V one = Ops::set(1.0f);
+  const V pipeArea = Ops::set(s.pipeLength * s.pipeLength);
+  const V pipeLength = Ops::set(s.pipeLength);
+  const V tiltMin = Ops::set(s.tiltMin);
+  float lanes[6][Ops::width] = {};
 
-  //vertical side
-  float vHeightDelta = 0.0;
-  index = 0;
-  bool b;
-  Crd bSide = getCoordAtDir(Crd(x, y), BOTTOM, size, b);
-  if(!b)
+  for(int x = x0; x < x1; x += Ops::width)
   {
-    vHeightDelta += sim[x][y].b - sim[bSide.x][bSide.y].b;
-    ++index;
+    V height = Ops::load(r.row + x);
+    V hDelta = Ops::mul(Ops::add(Ops::sub(height, Ops::load(left + x)), Ops::sub(Ops::load(right + x), height)), Ops::set(hScale));
+    V vDelta = Ops::mul(Ops::add(Ops::sub(height, Ops::load(r.up + x)), Ops::sub(Ops::load(r.down + x), height)), Ops::set(r.vScale));
+
+    //the normal is (hDelta, pipeLength, vDelta) normalised, and the slope the sine of its angle from vertical
+    V across = Ops::add(Ops::mul(hDelta, hDelta), Ops::mul(vDelta, vDelta));
+    V magnitude = Ops::sqrt(Ops::add(across, pipeArea));
+    V sinOfAngle = Ops::vmax(Ops::div(Ops::sqrt(across), magnitude), tiltMin);
+
+    V wet = zero;
+    if(r.water != NULL)
+      wet = ramp<Ops>(Ops::load(r.water + x), s.waterStart, s.waterEnd);
+    if(r.sediment != NULL)
+      wet = Ops::vmax(wet, ramp<Ops>(Ops::load(r.sediment + x), s.sedimentStart, s.sedimentEnd));
+    V dry = Ops::sub(one, wet);
+    V rock = ramp<Ops>(sinOfAngle, s.rockStart, s.rockEnd);
+    V snow = Ops::mul(ramp<Ops>(height, s.snowStart, s.snowEnd), Ops::sub(one, rock));
+
+    //running totals of alpha, green and blue, so the rounded weights add up to exactly 255
+    V green = Ops::add(wet, Ops::mul(rock, dry));
+    Ops::store(lanes[0], wet);
+    Ops::store(lanes[1], green);
+    Ops::store(lanes[2], Ops::add(green, Ops::mul(snow, dry)));
+
+    if(r.normals != NULL)
+    {
+      V half = Ops::set(0.5f);
+      V scale = Ops::div(Ops::set(-0.5f), magnitude);
+      Ops::store(lanes[3], Ops::add(Ops::mul(hDelta, scale), half));
+      Ops::store(lanes[4], Ops::add(Ops::mul(vDelta, scale), half));
+      Ops::store(lanes[5], Ops::add(Ops::div(Ops::mul(pipeLength, half), magnitude), half));
+    }
+
+    for(int k = 0; k < Ops::width; k++)
+    {
+      unsigned char* splat = r.splat + 4 * (x + k);
+      int alpha = toByte(lanes[0][k]);
+      int green = toByte(lanes[1][k]);
+      int blue = toByte(lanes[2][k]);
+      splat[0] = (unsigned char)(255 - blue);
+      splat[1] = (unsigned char)(green - alpha);
+      splat[2] = (unsigned char)(blue - green);
+      splat[3] = (unsigned char)alpha;
+
+      if(r.normals != NULL)
+      {
+        unsigned char* normal = r.normals + 3 * (x + k);
+        for(int j = 0; j < 3; j++)
+          normal[j] = (unsigned char)toByte(lanes[3 + j][k]);
+      }
+    }
   }
+}
 
-  bool t;
-  Crd tSide = getCoordAtDir(Crd(x, y), TOP, size, t);
-  if(!t)
+unsigned char* genSplat(const float* height, const float* water, const float* sediment, int size, unsigned char* normals, const SplatSettings& settings)
+{
+  unsigned char* splat = new unsigned char[size_t(size) * size * 4];
+  ThreadPool pool(settings.threads);
+
+  int bands = std::min(size, pool.threadCount() * 4);
+  pool.parallelFor(bands, [&](int band)
   {
-    vHeightDelta += sim[tSide.x][tSide.y].b - sim[x][y].b;
-    ++index;
-  }
+    int yStart = int(int64_t(size) * band / bands);
+    int yEnd = int(int64_t(size) * (band + 1) / bands);
 
-  //adjust for boundary condition
-  if(index != 2)
-    vHeightDelta *= 2;
+    for(int y = yStart; y < yEnd; y++)
+    {
+      size_t offset = size_t(y) * size;
+      SplatRows r;
+      r.row = height + offset;
+      r.up = y > 0 ? r.row - size : r.row;
+      r.down = y < size - 1 ? r.row + size : r.row;
+      r.vScale = y > 0 && y < size - 1 ? 1.0f : 2.0f;
+      r.water = water != NULL ? water + offset : NULL;
+      r.sediment = sediment != NULL ? sediment + offset : NULL;
+      r.splat = splat + offset * 4;
+      r.normals = normals != NULL ? normals + offset * 3 : NULL;
 
-  //find normal (and normalize)
-  float normal[3] = {hHeightDelta, PIPE_LENGTH, vHeightDelta};
-  float magnitude = sqrt(pow(normal[0], 2) + pow(normal[1], 2) + pow(normal[2], 2));
-  normal[0] /= magnitude;
-  normal[1] /= magnitude;
-  normal[2] /= magnitude;
+      if(size == 1)
+      {
+        splatSpan<ScalarOps>(r, r.row, r.row, 2, 0, 1, settings);
+        continue;
+      }
+
+      //edge cells, then the ones in between a whole vector at a time
+      int end = size - 1 - (size - 2) % VectorOps::width;
+      splatSpan<ScalarOps>(r, r.row, r.row + 1, 2, 0, 1, settings);
+      splatSpan<VectorOps>(r, r.row - 1, r.row + 1, 1, 1, end, settings);
+      splatSpan<ScalarOps>(r, r.row - 1, r.row + 1, 1, end, size - 1, settings);
+      splatSpan<ScalarOps>(r, r.row - 1, r.row, 2, size - 1, size, settings);
+    }
+  });
 
-  float sinOfAngle = std::max(TILT_MIN, float(sqrt(1.0 - pow(normal[1], 2))));
+  return splat;
 }
 
 //helper function to bicubicInterpolate()
@@ -130,50 +217,126 @@ float cubicInterpolate(float x, float y0, float y1, float y2, float y3)
   return (a0*x*mu2+a1*mu2+a2*x+a3);
 }
 
-void bicubicInterpolate(float* original, int originalSize, float* smoothed, int size)
+//cubicInterpolate() across a row, for the same x at every point
+//the operations are the same and in the same order, so every lane matches the scalar result
+template<class Ops>
+int cubicInterpolateSpan(float x, const float* y0, const float* y1, const float* y2, const float* y3, float* out, int start, int end)
+{
+  typedef typename Ops::V V;
+  const V vx = Ops::set(x);
+  const V mu2 = Ops::set(x * x);
+
+  int i = start;
+  for(; i + Ops::width <= end; i += Ops::width)
+  {
+    V p0 = Ops::load(y0 + i);
+    V p1 = Ops::load(y1 + i);
+    V p2 = Ops::load(y2 + i);
+    V p3 = Ops::load(y3 + i);
+
+    V a0 = Ops::add(Ops::sub(Ops::sub(p3, p2), p0), p1);
+    V a1 = Ops::sub(Ops::sub(p0, p1), a0);
+    V a2 = Ops::sub(p2, p0);
+
+    V sum = Ops::add(Ops::mul(Ops::mul(a0, vx), mu2), Ops::mul(a1, mu2));
+    Ops::store(out + i, Ops::add(Ops::add(sum, Ops::mul(a2, vx)), p1));
+  }
+  return i;
+}
+
+//separable: every row of the bordered source is interpolated across once, into a size wide buffer,
+//then each output row is one cubic down four of those rows
+//source positions and offsets for each output column and row are worked out once up front
+//gives exactly the same values as interpolating each output point on its own
+void bicubicInterpolate(float* original, int originalSize, float* smoothed, int size, int threads)
 {
   //this is the change factor
   //when a coordinate for the new grid is multiplied by this coefficient, it is converted to an old coordinate
   float cF = (float(originalSize) - 1) / (float(size) - 1);
+  int adjustedSize = originalSize + 2;
 
   //make array with approximations
-  float* adjusted = new float[(originalSize + 2) * (originalSize + 2)];
+  std::vector<float> adjusted(adjustedSize * adjustedSize);
   adjustArray(&original[0], originalSize, &adjusted[0]);
-  //printArray(&adjusted[0], originalSize + 2);
 
-  //iterate through each index on the scaled array
-  for(int y = 0; y < size; y++)
+  //nearest old coordinate (rounded down) and the offset past it, the same for x and y
+  std::vector<int> down(size);
+  std::vector<float> offset(size);
+  for(int i = 0; i < size; i++)
+  {
+    int d = floor(i * cF + 1);
+    if(d == originalSize)
+      d = originalSize - 1;
+
+    down[i] = d;
+    offset[i] = (i * cF + 1) - d;
+  }
+
+  ThreadPool pool(threads);
+
+  //horizontal pass
+  std::vector<float> across(size_t(adjustedSize) * size);
+  pool.parallelFor(adjustedSize, [&](int row)
   {
+    const float* src = &adjusted[coord(0, row, adjustedSize)];
+    float* dst = &across[size_t(row) * size];
+
     for(int x = 0; x < size; x++)
     {
-      //find nearest old coordinates that correspond to these (rounded down)
-      int xDown = floor(x * cF + 1);
-      if(xDown == originalSize)
-        xDown = originalSize - 1;
+      const float* p = src + down[x];
+      dst[x] = cubicInterpolate(offset[x], p[-1], p[0], p[1], p[2]);
+    }
+  });
+
+  //vertical pass, in bands of rows
+  int bands = std::min(size, pool.threadCount() * 4);
+  pool.parallelFor(bands, [&](int band)
+  {
+    int yStart = int(int64_t(size) * band / bands);
+    int yEnd = int(int64_t(size) * (band + 1) / bands);
 
-      int yDown = floor(y * cF + 1);
-      if(yDown == originalSize)
-        yDown = originalSize - 1;
+    for(int y = yStart; y < yEnd; y++)
+    {
+      const float* rows = &across[size_t(down[y] - 1) * size];
+      float* out = smoothed + size_t(y) * size;
 
-      float interps[4];
-      int index = 0;
+      int x = cubicInterpolateSpan<VectorOps>(offset[y], rows, rows + size, rows + 2 * size, rows + 3 * size, out, 0, size);
+      cubicInterpolateSpan<ScalarOps>(offset[y], rows, rows + size, rows + 2 * size, rows + 3 * size, out, x, size);
+    }
+  });
+}
 
-      //for each new index, four parallel cubic interpolations are done
-      //coordinate should lie between second and third interp
-      for(int i = yDown - 1; i <= yDown + 2; i++)
+//halves the resolution of a field: reduced point (x, y) sits on original point (2x, 2y) and is the
+//1 2 1 weighted average of the 3 * 3 points around it, renormalised where they run off the edge
+//size must be (originalSize - 1) / 2 + 1
+void downsampleField(float* original, int originalSize, float* reduced, int size)
+{
+  for(int y = 0; y < size; y++)
+  {
+    for(int x = 0; x < size; x++)
+    {
+      float sum = 0;
+      float weights = 0;
+
+      for(int dy = -1; dy <= 1; dy++)
       {
-        float pVals[4];
-        pVals[0] = adjusted[coord(xDown - 1, i, originalSize + 2)];
-        pVals[1] = adjusted[coord(xDown, i, originalSize + 2)];
-        pVals[2] = adjusted[coord(xDown + 1, i, originalSize + 2)];
-        pVals[3] = adjusted[coord(xDown + 2, i, originalSize + 2)];
-
-        interps[index] = cubicInterpolate((x * cF + 1) - xDown, pVals[0], pVals[1], pVals[2], pVals[3]);
-        ++index;
+        int oy = 2 * y + dy;
+        if(oy < 0 || oy >= originalSize)
+          continue;
+
+        for(int dx = -1; dx <= 1; dx++)
+        {
+          int ox = 2 * x + dx;
+          if(ox < 0 || ox >= originalSize)
+            continue;
+
+          float weight = float((dx == 0 ? 2 : 1) * (dy == 0 ? 2 : 1));
+          sum += weight * original[coord(ox, oy, originalSize)];
+          weights += weight;
+        }
       }
 
-      //interpolate between previous interpolations
-      smoothed[coord(x, y, size)] = cubicInterpolate((y * cF + 1) - yDown, interps[0], interps[1], interps[2], interps[3]);
+      reduced[coord(x, y, size)] = sum / weights;
     }
   }
 }
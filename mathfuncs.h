@@ -5,6 +5,45 @@ int coord(int x, int y, int size);
 void adjustArray(float* graph, int size, float* newArray);
 void printArray(float* matrix, int size);
 float cubicInterpolate(float x, float y0, float y1, float y2, float y3);
-void bicubicInterpolate(float* original, int originalSize, float* smoothed, int size);
+//threads used for the interpolation, 0 uses every hardware thread
+void bicubicInterpolate(float* original, int originalSize, float* smoothed, int size, int threads = 0);
+void downsampleField(float* original, int originalSize, float* reduced, int size);
+
+//what genSplat() puts in each channel of a splat map, as weights from 0 to 255 adding up to 255:
+//alpha is wet ground, green is rock on slopes, blue is snow on high ground of the rest, red is whatever is left
+//each weight ramps linearly from nothing at its start to full at its end
+struct SplatSettings
+{
+  SplatSettings()
+    : threads(0), pipeLength(0.001f), tiltMin(0), rockStart(0.6f), rockEnd(0.9f), snowStart(0.85f), snowEnd(0.95f),
+      waterStart(0.001f), waterEnd(0.01f), sedimentStart(0.0001f), sedimentEnd(0.001f) {}
+
+  //threads used, 0 uses every hardware thread
+  int threads;
+
+  //slope is the sine of the angle Step 5 of the erosion works out, with the same constants as ErosionParams
+  //cells are pipeLength apart whatever the size, so the same terrain comes out steeper at smaller sizes
+  float pipeLength;
+  float tiltMin;
+  float rockStart;
+  float rockEnd;
+
+  //terrain height
+  float snowStart;
+  float snowEnd;
+
+  //water depth or sediment, whichever is wetter
+  float waterStart;
+  float waterEnd;
+  float sedimentStart;
+  float sedimentEnd;
+};
+
+//splat map of a size * size row-major heightmap, 4 bytes (red, green, blue, alpha) per cell
+//water and sediment, either of which may be NULL, are laid out like the heights
+//normals, unless NULL, receives a normal map of 3 bytes per cell: x and y along the rows and columns
+//of the heightmap and z up, each mapped from [-1, 1] onto [0, 255]
+//everything is worked out in one threaded sweep over the rows; returns the splat map, allocated with new[]
+unsigned char* genSplat(const float* height, const float* water, const float* sediment, int size, unsigned char* normals, const SplatSettings& settings = SplatSettings());
 
 #endif
@@ -0,0 +1,819 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "imageio.h"
+#include "png.h"
+
+using namespace std;
+
+//filtered bytes compressed together as one independent deflate segment
+const size_t PNG_CHUNK_BYTES = size_t(1) << 20;
+
+//symbols per deflate block, each block getting its own Huffman codes
+const int DEFLATE_BLOCK_SYMBOLS = 1 << 15;
+
+const int DEFLATE_WINDOW = 32768;
+const int DEFLATE_HASH_BITS = 15;
+const int DEFLATE_MIN_MATCH = 4;
+const int DEFLATE_MAX_MATCH = 258;
+
+//candidates checked per position, enough to find the long runs of flat ground without slowing on rough terrain
+const int DEFLATE_MAX_CHAIN = 8;
+
+const int LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115,
+  131, 163, 195, 227, 258};
+const int LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const int DISTANCE_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025,
+  1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const int DISTANCE_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12,
+  12, 13, 13};
+
+//order the code length code lengths are sent in
+const int CODE_LENGTH_ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+//lookups from match length and distance to their codes, and the CRC table
+struct DeflateTables
+{
+  DeflateTables()
+  {
+    for(int c = 0; c < 29; c++)
+    {
+      for(int len = LENGTH_BASE[c]; len < LENGTH_BASE[c] + (1 << LENGTH_EXTRA[c]) && len <= DEFLATE_MAX_MATCH; len++)
+        lengthCode[len] = uint8_t(c);
+    }
+
+    //distances up to 256 are looked up directly, longer ones by their top bits, which all share a code
+    for(int c = 0; c < 30; c++)
+    {
+      for(int d = DISTANCE_BASE[c]; d < DISTANCE_BASE[c] + (1 << DISTANCE_EXTRA[c]); d++)
+      {
+        if(d <= 256)
+          nearDistanceCode[d - 1] = uint8_t(c);
+        else
+          farDistanceCode[(d - 1) >> 7] = uint8_t(c);
+      }
+    }
+
+    for(uint32_t n = 0; n < 256; n++)
+    {
+      uint32_t c = n;
+      for(int k = 0; k < 8; k++)
+        c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      crc[n] = c;
+    }
+  }
+
+  int distanceCode(int distance) const
+  {
+    return distance <= 256 ? nearDistanceCode[distance - 1] : farDistanceCode[(distance - 1) >> 7];
+  }
+
+  uint8_t lengthCode[DEFLATE_MAX_MATCH + 1];
+  uint8_t nearDistanceCode[256];
+  uint8_t farDistanceCode[256];
+  uint32_t crc[256];
+};
+
+const DeflateTables& deflateTables()
+{
+  static const DeflateTables tables;
+  return tables;
+}
+
+//crc of data appended to what crc was taken over, starting from 0
+uint32_t crc32(uint32_t crc, const unsigned char* data, size_t bytes)
+{
+  const uint32_t* table = deflateTables().crc;
+  uint32_t c = crc ^ 0xFFFFFFFFu;
+  for(size_t i = 0; i < bytes; i++)
+    c = table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+  return c ^ 0xFFFFFFFFu;
+}
+
+const uint32_t ADLER_BASE = 65521;
+
+uint32_t adler32(const unsigned char* data, size_t bytes)
+{
+  uint32_t a = 1;
+  uint32_t b = 0;
+  while(bytes > 0)
+  {
+    //the largest run that cannot overflow b before the modulo
+    size_t run = min(bytes, size_t(5552));
+    for(size_t i = 0; i < run; i++)
+    {
+      a += data[i];
+      b += a;
+    }
+    a %= ADLER_BASE;
+    b %= ADLER_BASE;
+    data += run;
+    bytes -= run;
+  }
+  return (b << 16) | a;
+}
+
+//adler of two runs of data back to back, given the adler of each and the length of the second
+uint32_t adler32Combine(uint32_t first, uint32_t second, size_t secondBytes)
+{
+  uint32_t rem = uint32_t(secondBytes % ADLER_BASE);
+  uint32_t a = first & 0xFFFF;
+  uint32_t b = uint32_t(uint64_t(rem) * a % ADLER_BASE);
+  a += (second & 0xFFFF) + ADLER_BASE - 1;
+  b += (first >> 16) + (second >> 16) + ADLER_BASE - rem;
+  if(a >= ADLER_BASE)
+    a -= ADLER_BASE;
+  if(a >= ADLER_BASE)
+    a -= ADLER_BASE;
+  if(b >= 2 * ADLER_BASE)
+    b -= 2 * ADLER_BASE;
+  if(b >= ADLER_BASE)
+    b -= ADLER_BASE;
+  return (b << 16) | a;
+}
+
+//deflate packs bits from the least significant end of each byte
+class BitWriter
+{
+public:
+  BitWriter(vector<unsigned char>& out) : out(out), bits(0), count(0) {}
+
+  void put(uint32_t value, int n)
+  {
+    bits |= uint64_t(value) << count;
+    count += n;
+    if(count >= 32)
+    {
+      unsigned char bytes[4] = {(unsigned char)bits, (unsigned char)(bits >> 8), (unsigned char)(bits >> 16),
+        (unsigned char)(bits >> 24)};
+      out.insert(out.end(), bytes, bytes + 4);
+      bits >>= 32;
+      count -= 32;
+    }
+  }
+
+  void align()
+  {
+    for(; count > 0; count -= 8)
+    {
+      out.push_back((unsigned char)bits);
+      bits >>= 8;
+    }
+    bits = 0;
+    count = 0;
+  }
+
+  vector<unsigned char>& out;
+
+private:
+  uint64_t bits;
+  int count;
+};
+
+//a Huffman code over n symbols, with no code longer than maxBits
+struct HuffmanCode
+{
+  void build(const uint32_t* freq, int n, int maxBits);
+
+  uint8_t lengths[286];
+
+  //bit-reversed, ready for BitWriter
+  uint16_t codes[286];
+};
+
+void HuffmanCode::build(const uint32_t* freq, int n, int maxBits)
+{
+  vector<pair<uint32_t, int> > used;
+  for(int i = 0; i < n; i++)
+  {
+    lengths[i] = 0;
+    codes[i] = 0;
+    if(freq[i] > 0)
+      used.push_back(make_pair(freq[i], i));
+  }
+
+  //callers make sure at least two symbols are used, so the code is complete
+  int m = int(used.size());
+  sort(used.begin(), used.end());
+
+  //two-queue Huffman: leaves in order of frequency, and internal nodes, which come out in order of weight
+  vector<uint64_t> weight(2 * m);
+  vector<int> parent(2 * m, 0);
+  for(int i = 0; i < m; i++)
+    weight[i] = used[i].first;
+
+  int leaf = 0;
+  int node = m;
+  for(int next = m; next < 2 * m - 1; next++)
+  {
+    int pair[2];
+    for(int k = 0; k < 2; k++)
+    {
+      if(leaf < m && (node >= next || weight[leaf] <= weight[node]))
+        pair[k] = leaf++;
+      else
+        pair[k] = node++;
+    }
+    weight[next] = weight[pair[0]] + weight[pair[1]];
+    parent[pair[0]] = next;
+    parent[pair[1]] = next;
+  }
+
+  //parents always come after their children, so depths fill in from the root down
+  vector<int> depth(2 * m - 1, 0);
+  vector<int> lengthCount(max(m, maxBits) + 1, 0);
+  for(int i = 2 * m - 3; i >= 0; i--)
+  {
+    depth[i] = depth[parent[i]] + 1;
+    if(i < m)
+      lengthCount[min(depth[i], maxBits)]++;
+  }
+
+  //codes clamped to maxBits overfill it; moving a leaf down a level frees room until the code fits again
+  uint32_t total = 0;
+  for(int len = 1; len <= maxBits; len++)
+    total += uint32_t(lengthCount[len]) << (maxBits - len);
+  while(total > (1u << maxBits))
+  {
+    lengthCount[maxBits]--;
+    for(int len = maxBits - 1; len > 0; len--)
+    {
+      if(lengthCount[len] > 0)
+      {
+        lengthCount[len]--;
+        lengthCount[len + 1] += 2;
+        break;
+      }
+    }
+    total--;
+  }
+
+  //the rarest symbols get the longest codes
+  int symbol = 0;
+  for(int len = maxBits; len > 0; len--)
+  {
+    for(int k = 0; k < lengthCount[len]; k++)
+      lengths[used[symbol++].second] = uint8_t(len);
+  }
+
+  //canonical codes, as the decoder rebuilds them from the lengths alone
+  int nextCode[16] = {0};
+  int bitCount[16] = {0};
+  for(int i = 0; i < n; i++)
+    bitCount[lengths[i]]++;
+  bitCount[0] = 0;
+  for(int len = 1, code = 0; len <= 15; len++)
+  {
+    code = (code + bitCount[len - 1]) << 1;
+    nextCode[len] = code;
+  }
+
+  for(int i = 0; i < n; i++)
+  {
+    int len = lengths[i];
+    if(len == 0)
+      continue;
+
+    int code = nextCode[len]++;
+    int reversed = 0;
+    for(int k = 0; k < len; k++)
+      reversed |= ((code >> k) & 1) << (len - 1 - k);
+    codes[i] = uint16_t(reversed);
+  }
+}
+
+//gives unused symbols a count until at least two are used, as a one symbol code is incomplete
+void useTwoSymbols(uint32_t* freq, int n)
+{
+  int used = 0;
+  for(int i = 0; i < n; i++)
+    used += freq[i] > 0;
+  for(int i = 0; i < n && used < 2; i++)
+  {
+    if(freq[i] == 0)
+    {
+      freq[i] = 1;
+      used++;
+    }
+  }
+}
+
+//LZ77 output waiting to be Huffman coded: a literal byte (distance 0) or a match of length at distance
+struct DeflateSymbols
+{
+  vector<uint16_t> values;
+  vector<uint16_t> distances;
+};
+
+//writes the symbols as one block with its own (dynamic) Huffman codes
+void writeBlock(BitWriter& out, const DeflateSymbols& symbols, bool final)
+{
+  const DeflateTables& tables = deflateTables();
+  size_t count = symbols.values.size();
+
+  uint32_t literalFreq[286] = {0};
+  uint32_t distanceFreq[30] = {0};
+  for(size_t s = 0; s < count; s++)
+  {
+    int distance = symbols.distances[s];
+    if(distance == 0)
+      literalFreq[symbols.values[s]]++;
+    else
+    {
+      literalFreq[257 + tables.lengthCode[symbols.values[s]]]++;
+      distanceFreq[tables.distanceCode(distance)]++;
+    }
+  }
+  literalFreq[256] = 1;
+  useTwoSymbols(literalFreq, 286);
+  useTwoSymbols(distanceFreq, 30);
+
+  HuffmanCode literals;
+  HuffmanCode distances;
+  literals.build(literalFreq, 286, 15);
+  distances.build(distanceFreq, 30, 15);
+
+  int literalCount = 286;
+  while(literals.lengths[literalCount - 1] == 0)
+    literalCount--;
+  int distanceCount = 30;
+  while(distances.lengths[distanceCount - 1] == 0)
+    distanceCount--;
+
+  //both sets of lengths are sent as one run-length coded list: 16 repeats the last length 3 to 6 times,
+  //17 and 18 give 3 to 10 and 11 to 138 zeroes
+  vector<uint8_t> lengths(literals.lengths, literals.lengths + literalCount);
+  lengths.insert(lengths.end(), distances.lengths, distances.lengths + distanceCount);
+
+  vector<uint8_t> runSymbols;
+  vector<uint8_t> runExtra;
+  uint32_t lengthFreq[19] = {0};
+  for(size_t i = 0; i < lengths.size();)
+  {
+    size_t run = 1;
+    while(i + run < lengths.size() && lengths[i + run] == lengths[i])
+      run++;
+
+    if(lengths[i] == 0 && run >= 3)
+    {
+      run = min(run, size_t(138));
+      runSymbols.push_back(run >= 11 ? 18 : 17);
+      runExtra.push_back(uint8_t(run >= 11 ? run - 11 : run - 3));
+    }
+    else if(lengths[i] != 0 && run >= 4)
+    {
+      run = min(run, size_t(7));
+      runSymbols.push_back(lengths[i]);
+      runExtra.push_back(0);
+      runSymbols.push_back(16);
+      runExtra.push_back(uint8_t(run - 4));
+    }
+    else
+    {
+      run = 1;
+      runSymbols.push_back(lengths[i]);
+      runExtra.push_back(0);
+    }
+    i += run;
+  }
+  for(size_t i = 0; i < runSymbols.size(); i++)
+    lengthFreq[runSymbols[i]]++;
+  useTwoSymbols(lengthFreq, 19);
+
+  HuffmanCode lengthCode;
+  lengthCode.build(lengthFreq, 19, 7);
+  int lengthCodeCount = 19;
+  while(lengthCodeCount > 4 && lengthCode.lengths[CODE_LENGTH_ORDER[lengthCodeCount - 1]] == 0)
+    lengthCodeCount--;
+
+  out.put(final ? 1 : 0, 1);
+  out.put(2, 2);
+  out.put(literalCount - 257, 5);
+  out.put(distanceCount - 1, 5);
+  out.put(lengthCodeCount - 4, 4);
+  for(int i = 0; i < lengthCodeCount; i++)
+    out.put(lengthCode.lengths[CODE_LENGTH_ORDER[i]], 3);
+
+  for(size_t i = 0; i < runSymbols.size(); i++)
+  {
+    int symbol = runSymbols[i];
+    out.put(lengthCode.codes[symbol], lengthCode.lengths[symbol]);
+    if(symbol == 16)
+      out.put(runExtra[i], 2);
+    else if(symbol == 17)
+      out.put(runExtra[i], 3);
+    else if(symbol == 18)
+      out.put(runExtra[i], 7);
+  }
+
+  for(size_t s = 0; s < count; s++)
+  {
+    int value = symbols.values[s];
+    int distance = symbols.distances[s];
+    if(distance == 0)
+    {
+      out.put(literals.codes[value], literals.lengths[value]);
+      continue;
+    }
+
+    int lengthSymbol = tables.lengthCode[value];
+    out.put(literals.codes[257 + lengthSymbol], literals.lengths[257 + lengthSymbol]);
+    out.put(value - LENGTH_BASE[lengthSymbol], LENGTH_EXTRA[lengthSymbol]);
+
+    int distanceSymbol = tables.distanceCode(distance);
+    out.put(distances.codes[distanceSymbol], distances.lengths[distanceSymbol]);
+    out.put(distance - DISTANCE_BASE[distanceSymbol], DISTANCE_EXTRA[distanceSymbol]);
+  }
+
+  out.put(literals.codes[256], literals.lengths[256]);
+}
+
+uint32_t load32(const unsigned char* p)
+{
+  uint32_t value;
+  memcpy(&value, p, 4);
+  return value;
+}
+
+//compresses data on its own, with no matches reaching back before it, and appends it to out
+//a segment that is not final ends on a byte boundary (after an empty stored block, as a zlib sync flush does),
+//so segments compressed apart can be written back to back as one stream
+void deflateSegment(const unsigned char* data, size_t bytes, bool final, vector<unsigned char>& out)
+{
+  BitWriter writer(out);
+  DeflateSymbols symbols;
+  symbols.values.reserve(DEFLATE_BLOCK_SYMBOLS);
+  symbols.distances.reserve(DEFLATE_BLOCK_SYMBOLS);
+
+  //greedy matching along hash chains of 4 byte prefixes
+  vector<int32_t> head(size_t(1) << DEFLATE_HASH_BITS, -1);
+  vector<int32_t> chain(bytes);
+
+  size_t i = 0;
+  while(i < bytes)
+  {
+    int best = 0;
+    int bestDistance = 0;
+    if(i + DEFLATE_MIN_MATCH <= bytes)
+    {
+      uint32_t hash = (load32(data + i) * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+      int32_t candidate = head[hash];
+      head[hash] = int32_t(i);
+      chain[i] = candidate;
+
+      int longest = int(min(bytes - i, size_t(DEFLATE_MAX_MATCH)));
+      for(int tries = 0; candidate >= 0 && i - candidate <= size_t(DEFLATE_WINDOW) && tries < DEFLATE_MAX_CHAIN; tries++)
+      {
+        const unsigned char* a = data + candidate;
+        const unsigned char* b = data + i;
+        if(a[best] == b[best])
+        {
+          int len = 0;
+          while(len < longest && a[len] == b[len])
+            len++;
+          if(len > best)
+          {
+            best = len;
+            bestDistance = int(i - candidate);
+            if(len == longest)
+              break;
+          }
+        }
+        candidate = chain[candidate];
+      }
+    }
+
+    if(best >= DEFLATE_MIN_MATCH)
+    {
+      symbols.values.push_back(uint16_t(best));
+      symbols.distances.push_back(uint16_t(bestDistance));
+
+      //the bytes matched still go into the chains, for later matches to find
+      size_t end = min(i + best, bytes - DEFLATE_MIN_MATCH + 1);
+      for(size_t k = i + 1; k < end; k++)
+      {
+        uint32_t hash = (load32(data + k) * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+        chain[k] = head[hash];
+        head[hash] = int32_t(k);
+      }
+      i += best;
+    }
+    else
+    {
+      symbols.values.push_back(data[i]);
+      symbols.distances.push_back(0);
+      i++;
+    }
+
+    if(symbols.values.size() == size_t(DEFLATE_BLOCK_SYMBOLS) && i < bytes)
+    {
+      writeBlock(writer, symbols, false);
+      symbols.values.clear();
+      symbols.distances.clear();
+    }
+  }
+
+  writeBlock(writer, symbols, final);
+  if(!final)
+  {
+    writer.put(0, 3);
+    writer.align();
+    out.push_back(0);
+    out.push_back(0);
+    out.push_back(0xFF);
+    out.push_back(0xFF);
+  }
+  writer.align();
+}
+
+int paeth(int a, int b, int c)
+{
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if(pa <= pb && pa <= pc)
+    return a;
+  return pb <= pc ? b : c;
+}
+
+//filters one byte from its left (a), upper (b) and upper left (c) neighbours, returning the size of the difference
+//as a signed byte
+template<int TYPE>
+int filterByte(int x, int a, int b, int c, unsigned char* out)
+{
+  int predicted = 0;
+  if(TYPE == 1)
+    predicted = a;
+  else if(TYPE == 2)
+    predicted = b;
+  else if(TYPE == 3)
+    predicted = (a + b) >> 1;
+  else if(TYPE == 4)
+    predicted = paeth(a, b, c);
+
+  unsigned char value = (unsigned char)(x - predicted);
+  *out = value;
+  return value < 128 ? value : 256 - value;
+}
+
+//the first bpp bytes have nothing to their left, the rest run without a branch
+template<int TYPE>
+long filterWith(const unsigned char* row, const unsigned char* above, size_t bytes, int bpp, unsigned char* out)
+{
+  long sum = 0;
+  size_t head = min(size_t(bpp), bytes);
+  for(size_t i = 0; i < head; i++)
+    sum += filterByte<TYPE>(row[i], 0, above[i], 0, out + i);
+  for(size_t i = head; i < bytes; i++)
+    sum += filterByte<TYPE>(row[i], row[i - bpp], above[i], above[i - bpp], out + i);
+  return sum;
+}
+
+//filters a row against the one above with whichever of the five PNG filters leaves the smallest sum of
+//differences (as signed bytes), the usual guess at what deflates best; out gets the filter type, then the row
+void filterRow(const unsigned char* row, const unsigned char* above, size_t bytes, int bpp, unsigned char* out,
+  vector<unsigned char>& scratch)
+{
+  scratch.resize(bytes);
+  out[0] = 0;
+  long bestSum = filterWith<0>(row, above, bytes, bpp, out + 1);
+
+  for(int type = 1; type < 5; type++)
+  {
+    long sum = 0;
+    switch(type)
+    {
+    case 1: sum = filterWith<1>(row, above, bytes, bpp, &scratch[0]); break;
+    case 2: sum = filterWith<2>(row, above, bytes, bpp, &scratch[0]); break;
+    case 3: sum = filterWith<3>(row, above, bytes, bpp, &scratch[0]); break;
+    case 4: sum = filterWith<4>(row, above, bytes, bpp, &scratch[0]); break;
+    }
+
+    if(sum < bestSum)
+    {
+      bestSum = sum;
+      out[0] = (unsigned char)type;
+      memcpy(out + 1, &scratch[0], bytes);
+    }
+  }
+}
+
+PngWriter::PngWriter(const string& name, int width, int height, int channels, int bitDepth, int threads)
+  : width(width), height(height), channels(channels), bitDepth(bitDepth), rowsWritten(0), overflow(false),
+    pendingRows(0), started(false), adler(1), pool(threads)
+{
+  rowBytes = size_t(width) * channels * (bitDepth / 8);
+  chunkRows = int(max(PNG_CHUNK_BYTES / (rowBytes + 1), size_t(1)));
+  previous.assign(rowBytes, 0);
+
+  file.open(name, ios::binary);
+  if((channels < 1 || channels > 4) || (bitDepth != 8 && bitDepth != 16))
+  {
+    file.close();
+    return;
+  }
+
+  const unsigned char SIGNATURE[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  const unsigned char COLOUR_TYPES[4] = {0, 4, 2, 6};
+  file.write((const char*)SIGNATURE, 8);
+
+  unsigned char header[13] = {
+    (unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width,
+    (unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height,
+    (unsigned char)bitDepth, COLOUR_TYPES[channels - 1], 0, 0, 0};
+  writeChunk("IHDR", header, 13, crc32(crc32(0, (const unsigned char*)"IHDR", 4), header, 13));
+}
+
+bool PngWriter::isOpen() const
+{
+  return file.is_open() && file.good();
+}
+
+//samples are big-endian
+void PngWriter::encodeRow(const float* floats, const unsigned char* bytes, int row, unsigned char* out) const
+{
+  size_t samples = size_t(width) * channels;
+  if(bytes != NULL)
+  {
+    memcpy(out, bytes + size_t(row) * rowBytes, rowBytes);
+    return;
+  }
+
+  const float* in = floats + size_t(row) * samples;
+  if(bitDepth == 16)
+  {
+    for(size_t i = 0; i < samples; i++)
+    {
+      uint16_t sample = toSample(in[i]);
+      out[2 * i] = (unsigned char)(sample >> 8);
+      out[2 * i + 1] = (unsigned char)sample;
+    }
+  }
+  else
+  {
+    for(size_t i = 0; i < samples; i++)
+      out[i] = (unsigned char)(toSample(in[i]) >> 8);
+  }
+}
+
+void PngWriter::writeRows(const float* rows, int count)
+{
+  //a few chunks per thread at a time, so the filtered rows held stay small
+  int slice = chunkRows * pool.threadCount() * 2;
+  for(int start = 0; start < count; start += slice)
+    addRows(rows + size_t(start) * width * channels, NULL, min(slice, count - start));
+}
+
+void PngWriter::writeRows(const unsigned char* rows, int count)
+{
+  if(bitDepth != 8)
+  {
+    overflow = true;
+    return;
+  }
+
+  int slice = chunkRows * pool.threadCount() * 2;
+  for(int start = 0; start < count; start += slice)
+    addRows(NULL, rows + size_t(start) * rowBytes, min(slice, count - start));
+}
+
+void PngWriter::addRows(const float* floats, const unsigned char* bytes, int count)
+{
+  if(count > height - rowsWritten)
+  {
+    overflow = true;
+    count = height - rowsWritten;
+  }
+  if(count <= 0)
+    return;
+
+  size_t stride = rowBytes + 1;
+  size_t start = pending.size();
+  pending.resize(start + count * stride);
+  int bpp = channels * (bitDepth / 8);
+
+  int bands = min(count, pool.threadCount() * 4);
+  pool.parallelFor(bands, [&](int band)
+  {
+    int r0 = int(int64_t(count) * band / bands);
+    int r1 = int(int64_t(count) * (band + 1) / bands);
+    vector<unsigned char> above(rowBytes);
+    vector<unsigned char> row(rowBytes);
+    vector<unsigned char> scratch;
+
+    if(r0 == 0)
+      above = previous;
+    else
+      encodeRow(floats, bytes, r0 - 1, &above[0]);
+
+    for(int r = r0; r < r1; r++)
+    {
+      encodeRow(floats, bytes, r, &row[0]);
+      filterRow(&row[0], &above[0], rowBytes, bpp, &pending[start + r * stride], scratch);
+      above.swap(row);
+    }
+  });
+
+  encodeRow(floats, bytes, count - 1, &previous[0]);
+  rowsWritten += count;
+  pendingRows += count;
+
+  int chunks = pendingRows / chunkRows;
+  if(chunks > 0)
+    compressChunks(chunks, false);
+}
+
+void PngWriter::compressChunks(int chunks, bool last)
+{
+  size_t stride = rowBytes + 1;
+  vector<vector<unsigned char> > out(chunks);
+  vector<uint32_t> adlers(chunks);
+  vector<uint32_t> crcs(chunks);
+  vector<size_t> sizes(chunks);
+
+  pool.parallelFor(chunks, [&](int c)
+  {
+    int rows = min(chunkRows, pendingRows - c * chunkRows);
+    const unsigned char* data = pending.empty() ? NULL : &pending[c * chunkRows * stride];
+    sizes[c] = rows * stride;
+    adlers[c] = adler32(data, sizes[c]);
+
+    //the zlib header: deflate with a 32K window, no preset dictionary
+    if(c == 0 && !started)
+    {
+      out[c].push_back(0x78);
+      out[c].push_back(0x01);
+    }
+    out[c].reserve(out[c].size() + sizes[c] + sizes[c] / 8 + 64);
+    deflateSegment(data, sizes[c], last && c == chunks - 1, out[c]);
+    crcs[c] = crc32(crc32(0, (const unsigned char*)"IDAT", 4), &out[c][0], out[c].size());
+  });
+  started = true;
+
+  for(int c = 0; c < chunks; c++)
+  {
+    adler = adler32Combine(adler, adlers[c], sizes[c]);
+
+    //the stream ends with the adler of everything compressed, which is only known now
+    if(last && c == chunks - 1)
+    {
+      unsigned char trailer[4] = {(unsigned char)(adler >> 24), (unsigned char)(adler >> 16),
+        (unsigned char)(adler >> 8), (unsigned char)adler};
+      out[c].insert(out[c].end(), trailer, trailer + 4);
+      crcs[c] = crc32(crcs[c], trailer, 4);
+    }
+    writeChunk("IDAT", &out[c][0], out[c].size(), crcs[c]);
+  }
+
+  int rows = min(pendingRows, chunks * chunkRows);
+  pending.erase(pending.begin(), pending.begin() + rows * stride);
+  pendingRows -= rows;
+}
+
+void PngWriter::writeChunk(const char* type, const unsigned char* data, size_t bytes, uint32_t crc)
+{
+  unsigned char length[4] = {(unsigned char)(bytes >> 24), (unsigned char)(bytes >> 16), (unsigned char)(bytes >> 8),
+    (unsigned char)bytes};
+  unsigned char check[4] = {(unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8),
+    (unsigned char)crc};
+  file.write((const char*)length, 4);
+  file.write(type, 4);
+  file.write((const char*)data, streamsize(bytes));
+  file.write((const char*)check, 4);
+}
+
+bool PngWriter::close()
+{
+  if(!file.is_open())
+    return false;
+
+  //the last chunk (possibly empty) ends the stream
+  compressChunks(max((pendingRows + chunkRows - 1) / chunkRows, 1), true);
+  writeChunk("IEND", NULL, 0, crc32(0, (const unsigned char*)"IEND", 4));
+
+  bool ok = isOpen() && !overflow && rowsWritten == height;
+  file.close();
+  return ok && !file.fail();
+}
+
+bool writePng(const string& name, const float* data, int size, int threads)
+{
+  PngWriter writer(name, size, size, 1, 16, threads);
+  if(!writer.isOpen())
+    return false;
+
+  writer.writeRows(data, size);
+  return writer.close();
+}
+
+bool writePng(const string& name, const unsigned char* pixels, int width, int height, int channels, int threads)
+{
+  PngWriter writer(name, width, height, channels, 8, threads);
+  if(!writer.isOpen())
+    return false;
+
+  writer.writeRows(pixels, height);
+  return writer.close();
+}
@@ -0,0 +1,71 @@
+#ifndef PNG_H
+#define PNG_H
+
+#include <stdint.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "ThreadPool.h"
+
+//writes a PNG a few rows at a time, like HeightmapWriter, with its own deflate so no external tool is needed
+//rows are filtered and deflated on a thread pool in chunks of about a megabyte, each compressed on its own and
+//stitched into the one zlib stream, so the file is the same for any thread count and however the rows are
+//split between calls
+class PngWriter
+{
+public:
+  //channels 1 (grey), 2 (grey and alpha), 3 (RGB) or 4 (RGBA) at a bitDepth of 8 or 16
+  //threads 0 uses every hardware thread
+  PngWriter(const std::string& name, int width, int height, int channels, int bitDepth, int threads = 0);
+
+  bool isOpen() const;
+
+  //appends count rows of width * channels interleaved samples
+  //floats are mapped from [0, 1] onto the full range of the bit depth as toSample() does; bytes need a bitDepth of 8
+  void writeRows(const float* rows, int count);
+  void writeRows(const unsigned char* rows, int count);
+
+  //ends the stream, returning false if the file could not be written or was not given exactly height rows
+  bool close();
+
+private:
+  PngWriter(const PngWriter&);
+  PngWriter& operator=(const PngWriter&);
+
+  void encodeRow(const float* floats, const unsigned char* bytes, int row, unsigned char* out) const;
+  void addRows(const float* floats, const unsigned char* bytes, int count);
+  void compressChunks(int chunks, bool last);
+  void writeChunk(const char* type, const unsigned char* data, size_t bytes, uint32_t crc);
+
+  std::ofstream file;
+  int width;
+  int height;
+  int channels;
+  int bitDepth;
+  size_t rowBytes;
+
+  //rows compressed together, set by the row size alone
+  int chunkRows;
+  int rowsWritten;
+  bool overflow;
+
+  //samples of the last row handed in, which the next row is filtered against
+  std::vector<unsigned char> previous;
+
+  //filtered rows (filter type byte first) waiting to fill a chunk
+  std::vector<unsigned char> pending;
+  int pendingRows;
+
+  bool started;
+  uint32_t adler;
+  ThreadPool pool;
+};
+
+//writes a size * size heightmap as a 16 bit greyscale PNG
+bool writePng(const std::string& name, const float* data, int size, int threads = 0);
+
+//writes a width * height image of 1 to 4 bytes per pixel as an 8 bit PNG
+bool writePng(const std::string& name, const unsigned char* pixels, int width, int height, int channels, int threads = 0);
+
+#endif
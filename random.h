@@ -0,0 +1,106 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+//counter-based random numbers (Philox4x32-10, Salmon et al. 2011)
+//a value depends only on the seed and its counter (domain, step, x, y), so every cell can be drawn
+//on its own, in any order and on any thread, and a terrain can be reproduced from its seed
+//there is no hidden state, and randomBits8() draws eight neighbouring cells at once in AVX2 builds
+
+//counter domains, keeping generators that share a seed apart
+const uint32_t RANDOM_START = 0;   //starting grids, step unused
+const uint32_t RANDOM_FRACTAL = 1; //diamond-square displacement, step is the iteration
+const uint32_t RANDOM_RAIN = 2;    //erosion rainfall, step is the iteration
+
+inline uint32_t philoxMulHiLo(uint32_t a, uint32_t b, uint32_t& hi)
+{
+  uint64_t product = uint64_t(a) * b;
+  hi = uint32_t(product >> 32);
+  return uint32_t(product);
+}
+
+//32 random bits for one counter
+inline uint32_t randomBits(uint64_t seed, uint32_t domain, uint32_t step, uint32_t x, uint32_t y)
+{
+  uint32_t c0 = x;
+  uint32_t c1 = y;
+  uint32_t c2 = step;
+  uint32_t c3 = domain;
+  uint32_t k0 = uint32_t(seed);
+  uint32_t k1 = uint32_t(seed >> 32);
+
+  for(int round = 0; round < 10; round++)
+  {
+    uint32_t hi0;
+    uint32_t hi1;
+    uint32_t lo0 = philoxMulHiLo(0xD2511F53, c0, hi0);
+    uint32_t lo1 = philoxMulHiLo(0xCD9E8D57, c2, hi1);
+
+    c0 = hi1 ^ c1 ^ k0;
+    c1 = lo1;
+    c2 = hi0 ^ c3 ^ k1;
+    c3 = lo0;
+
+    k0 += 0x9E3779B9;
+    k1 += 0xBB67AE85;
+  }
+
+  return c0;
+}
+
+//uniform float in [0, 1)
+inline float randomUnit(uint64_t seed, uint32_t domain, uint32_t step, uint32_t x, uint32_t y)
+{
+  return (randomBits(seed, domain, step, x, y) >> 8) * (1.0f / 16777216.0f);
+}
+
+#if defined(__AVX2__)
+
+//high and low halves of a * b for eight lanes of 32 bit unsigned integers
+inline __m256i philoxMulHiLo8(__m256i a, __m256i b, __m256i& hi)
+{
+  __m256i evenProducts = _mm256_mul_epu32(a, b);
+  __m256i oddProducts = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32));
+  hi = _mm256_blend_epi32(_mm256_srli_epi64(evenProducts, 32), oddProducts, 0xAA);
+  return _mm256_mullo_epi32(a, b);
+}
+
+//randomBits() for x, x + 1, ... x + 7
+inline __m256i randomBits8(uint64_t seed, uint32_t domain, uint32_t step, uint32_t x, uint32_t y)
+{
+  __m256i c0 = _mm256_add_epi32(_mm256_set1_epi32(int(x)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  __m256i c1 = _mm256_set1_epi32(int(y));
+  __m256i c2 = _mm256_set1_epi32(int(step));
+  __m256i c3 = _mm256_set1_epi32(int(domain));
+  uint32_t k0 = uint32_t(seed);
+  uint32_t k1 = uint32_t(seed >> 32);
+  const __m256i m0 = _mm256_set1_epi32(int(0xD2511F53));
+  const __m256i m1 = _mm256_set1_epi32(int(0xCD9E8D57));
+
+  for(int round = 0; round < 10; round++)
+  {
+    __m256i hi0;
+    __m256i hi1;
+    __m256i lo0 = philoxMulHiLo8(m0, c0, hi0);
+    __m256i lo1 = philoxMulHiLo8(m1, c2, hi1);
+
+    c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), _mm256_set1_epi32(int(k0)));
+    c1 = lo1;
+    c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), _mm256_set1_epi32(int(k1)));
+    c3 = lo0;
+
+    k0 += 0x9E3779B9;
+    k1 += 0xBB67AE85;
+  }
+
+  return c0;
+}
+
+#endif
+
+#endif
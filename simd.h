@@ -0,0 +1,188 @@
+#pragma once
+
+//thin wrappers over the widest float vector the compiler targets (AVX, SSE or plain floats)
+//kernels are written once as templates over VectorOps / ScalarOps, the scalar version handles row tails
+//vmax(a, b) and vmin(a, b) follow the SSE rule of returning b unless a is strictly greater (smaller),
+//so std::max(0.0f, x) is vmax(x, zero) and std::max(x, 0.0f) is vmax(zero, x)
+//load and store also take half floats (see half.h), converted with F16C where the compiler targets it
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE
+#endif
+
+#include <cmath>
+
+#include "half.h"
+
+#if (defined(__AVX__) || defined(SIMD_SSE)) && !defined(__F16C__)
+
+//SSE2 versions of the conversions in half.h for four values at a time, giving the same bits
+
+inline __m128 loadHalf4(const uint16_t* p)
+{
+  __m128i half = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128());
+  __m128i bits = _mm_slli_epi32(_mm_and_si128(half, _mm_set1_epi32(0x7FFF)), 13);
+  __m128i exponent = _mm_and_si128(bits, _mm_set1_epi32(0x0F800000));
+  bits = _mm_add_epi32(bits, _mm_set1_epi32(0x38000000));
+
+  //infinity or NaN
+  __m128i infinite = _mm_cmpeq_epi32(exponent, _mm_set1_epi32(0x0F800000));
+  bits = _mm_add_epi32(bits, _mm_and_si128(infinite, _mm_set1_epi32(0x38000000)));
+
+  //zero or subnormal, renormalised by a float subtraction
+  __m128i tiny = _mm_cmpeq_epi32(exponent, _mm_setzero_si128());
+  __m128 renormalised = _mm_sub_ps(_mm_castsi128_ps(_mm_add_epi32(bits, _mm_set1_epi32(0x00800000))), _mm_set1_ps(6.103515625e-05f));
+  bits = _mm_or_si128(_mm_and_si128(tiny, _mm_castps_si128(renormalised)), _mm_andnot_si128(tiny, bits));
+
+  bits = _mm_or_si128(bits, _mm_slli_epi32(_mm_and_si128(half, _mm_set1_epi32(0x8000)), 16));
+  return _mm_castsi128_ps(bits);
+}
+
+inline void storeHalf4(uint16_t* p, __m128 value)
+{
+  __m128i bits = _mm_castps_si128(value);
+  __m128i sign = _mm_and_si128(bits, _mm_set1_epi32(int(0x80000000)));
+  bits = _mm_xor_si128(bits, sign);
+
+  //rebias the exponent and round the 13 dropped bits to nearest even
+  __m128i odd = _mm_and_si128(_mm_srli_epi32(bits, 13), _mm_set1_epi32(1));
+  __m128i half = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(bits, _mm_set1_epi32(int(0xC8000FFF))), odd), 13);
+
+  //subnormal halves are rounded by a float addition
+  __m128i tiny = _mm_cmplt_epi32(bits, _mm_set1_epi32(0x38800000));
+  __m128i subnormal = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(_mm_castsi128_ps(bits), _mm_set1_ps(0.5f))), _mm_set1_epi32(0x3F000000));
+  half = _mm_or_si128(_mm_and_si128(tiny, subnormal), _mm_andnot_si128(tiny, half));
+
+  //too large for a half: infinity, or a quiet NaN
+  __m128i large = _mm_cmpgt_epi32(bits, _mm_set1_epi32(0x477FFFFF));
+  __m128i nan = _mm_and_si128(_mm_cmpgt_epi32(bits, _mm_set1_epi32(0x7F800000)), _mm_set1_epi32(0x0200));
+  __m128i infinite = _mm_or_si128(_mm_set1_epi32(0x7C00), nan);
+  half = _mm_or_si128(_mm_and_si128(large, infinite), _mm_andnot_si128(large, half));
+
+  //sign extend, so the saturating pack down to 16 bits keeps every bit
+  half = _mm_or_si128(half, _mm_srli_epi32(sign, 16));
+  half = _mm_srai_epi32(_mm_slli_epi32(half, 16), 16);
+  _mm_storel_epi64((__m128i*)p, _mm_packs_epi32(half, half));
+}
+
+#endif
+
+struct ScalarOps
+{
+  typedef float V;
+  typedef bool Mask;
+  static const int width = 1;
+
+  static V load(const float* p) { return *p; }
+  static void store(float* p, V a) { *p = a; }
+  static V load(const uint16_t* p) { return halfToFloat(*p); }
+  static void store(uint16_t* p, V a) { *p = floatToHalf(a); }
+  static V set(float a) { return a; }
+
+  static V add(V a, V b) { return a + b; }
+  static V sub(V a, V b) { return a - b; }
+  static V mul(V a, V b) { return a * b; }
+  static V div(V a, V b) { return a / b; }
+  static V sqrt(V a) { return std::sqrt(a); }
+  static V vmax(V a, V b) { return a > b ? a : b; }
+  static V vmin(V a, V b) { return a < b ? a : b; }
+
+  static V abs(V a) { return a < 0 ? -a : a; }
+
+  static Mask greater(V a, V b) { return a > b; }
+  static Mask greaterEqual(V a, V b) { return a >= b; }
+  static Mask less(V a, V b) { return a < b; }
+  static Mask lessEqual(V a, V b) { return a <= b; }
+  static Mask both(Mask a, Mask b) { return a && b; }
+  static bool allTrue(Mask m) { return m; }
+  static V select(Mask m, V a, V b) { return m ? a : b; }
+};
+
+#if defined(__AVX__)
+
+struct VectorOps
+{
+  typedef __m256 V;
+  typedef __m256 Mask;
+  static const int width = 8;
+
+  static V load(const float* p) { return _mm256_loadu_ps(p); }
+  static void store(float* p, V a) { _mm256_storeu_ps(p, a); }
+#if defined(__F16C__)
+  static V load(const uint16_t* p) { return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)p)); }
+  static void store(uint16_t* p, V a) { _mm_storeu_si128((__m128i*)p, _mm256_cvtps_ph(a, 0)); }
+#else
+  static V load(const uint16_t* p) { return _mm256_insertf128_ps(_mm256_castps128_ps256(loadHalf4(p)), loadHalf4(p + 4), 1); }
+  static void store(uint16_t* p, V a)
+  {
+    storeHalf4(p, _mm256_castps256_ps128(a));
+    storeHalf4(p + 4, _mm256_extractf128_ps(a, 1));
+  }
+#endif
+  static V set(float a) { return _mm256_set1_ps(a); }
+
+  static V add(V a, V b) { return _mm256_add_ps(a, b); }
+  static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+  static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+  static V div(V a, V b) { return _mm256_div_ps(a, b); }
+  static V sqrt(V a) { return _mm256_sqrt_ps(a); }
+  static V vmax(V a, V b) { return _mm256_max_ps(a, b); }
+  static V vmin(V a, V b) { return _mm256_min_ps(a, b); }
+
+  static V abs(V a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+
+  static Mask greater(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+  static Mask greaterEqual(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+  static Mask less(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+  static Mask lessEqual(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+  static Mask both(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+  static bool allTrue(Mask m) { return _mm256_movemask_ps(m) == 0xFF; }
+  static V select(Mask m, V a, V b) { return _mm256_blendv_ps(b, a, m); }
+};
+
+#elif defined(SIMD_SSE)
+
+struct VectorOps
+{
+  typedef __m128 V;
+  typedef __m128 Mask;
+  static const int width = 4;
+
+  static V load(const float* p) { return _mm_loadu_ps(p); }
+  static void store(float* p, V a) { _mm_storeu_ps(p, a); }
+#if defined(__F16C__)
+  static V load(const uint16_t* p) { return _mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)p)); }
+  static void store(uint16_t* p, V a) { _mm_storel_epi64((__m128i*)p, _mm_cvtps_ph(a, 0)); }
+#else
+  static V load(const uint16_t* p) { return loadHalf4(p); }
+  static void store(uint16_t* p, V a) { storeHalf4(p, a); }
+#endif
+  static V set(float a) { return _mm_set1_ps(a); }
+
+  static V add(V a, V b) { return _mm_add_ps(a, b); }
+  static V sub(V a, V b) { return _mm_sub_ps(a, b); }
+  static V mul(V a, V b) { return _mm_mul_ps(a, b); }
+  static V div(V a, V b) { return _mm_div_ps(a, b); }
+  static V sqrt(V a) { return _mm_sqrt_ps(a); }
+  static V vmax(V a, V b) { return _mm_max_ps(a, b); }
+  static V vmin(V a, V b) { return _mm_min_ps(a, b); }
+
+  static V abs(V a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+
+  static Mask greater(V a, V b) { return _mm_cmpgt_ps(a, b); }
+  static Mask greaterEqual(V a, V b) { return _mm_cmpge_ps(a, b); }
+  static Mask less(V a, V b) { return _mm_cmplt_ps(a, b); }
+  static Mask lessEqual(V a, V b) { return _mm_cmple_ps(a, b); }
+  static Mask both(Mask a, Mask b) { return _mm_and_ps(a, b); }
+  static bool allTrue(Mask m) { return _mm_movemask_ps(m) == 0xF; }
+  static V select(Mask m, V a, V b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+};
+
+#else
+
+typedef ScalarOps VectorOps;
+
+#endif